@@ -1,5 +1,6 @@
 
 #include "operations.hpp"
+#include "capture.hpp"
 #include "../rng.h"
 
 #include <iostream>
@@ -42,61 +43,82 @@ int main() {
 	vector<vector<Vec>> sequences(X.size(), vector<Vec>(X[0].size()));
 	for (size_t i = 0; i < X.size(); ++i) {
 		for (size_t j = 0; j < X[0].size(); ++j) {
-			sequences[i][j] = Vector::build(1, X[i][j]);
+			sequences[i][j] = Vector::constant(1, X[i][j]);
 		}
 	}
 
 	vector<Vec> Y = {
-		Vector::build(1, 0.0f),
-		Vector::build(1, 1.0f),
-		Vector::build(1, 1.0f),
-		Vector::build(1, 0.0f)
+		Vector::constant(1, 0.0f),
+		Vector::constant(1, 1.0f),
+		Vector::constant(1, 1.0f),
+		Vector::constant(1, 0.0f)
 	};
 
 
+	// every sequence has the same length, so the graph is only built for the first one
+	GraphCapture capture;
+
 	float lr = -0.5f;
+	auto update = [&](auto& param) {
+		param->value += param->partial * lr;
+		param->markDirty();
+	};
+
 	for (int iter = 0; iter < 5000; ++iter) {
 
-		size_t trainingIndex = iter % sequences.size();
-		vector<Vec> sequence = sequences[trainingIndex];
+		// only the partials of the weights are read, the ones of the unrolled cells can share their memory
+		BufferPool::Scope pool;
 
-		Vec z = sigmoid(Wz * sequence[0] + bz);
-		Vec r = sigmoid(Wr * sequence[0] + br);
-		Vec h_hat = tanh(Wr * sequence[0] + br);
-		Vec out_prev = hadamard(z, h_hat);
+		size_t trainingIndex = iter % sequences.size();
 
-		for (size_t j = 1; j < sequence.size(); ++j) {
-			z = sigmoid(Wz * sequence[j] + Uz * out_prev + bz);
-			r = sigmoid(Wr * sequence[j] + Ur * out_prev + br);
-			h_hat = tanh(Wr * sequence[j] + Uh * hadamard(r, out_prev) + br);
-			out_prev = out_prev - hadamard(out_prev, z) + hadamard(z, h_hat);
+		// one input per element of the sequence, and the target
+		vector<vector<NUM_TYPE>> data;
+		for (size_t j = 0; j < X[trainingIndex].size(); ++j) {
+			data.push_back({ X[trainingIndex][j] });
 		}
+		data.push_back(Y[trainingIndex]->value);
 
-		Vec out = sigmoid(W * out_prev + b);
+		Var loss = capture.replay(data, [&](const vector<Vec>& inputs) {
+			Vec z = sigmoid(Wz * inputs[0] + bz);
+			Vec r = sigmoid(Wr * inputs[0] + br);
+			Vec h_hat = tanh(Wr * inputs[0] + br);
+			Vec out_prev = hadamard(z, h_hat);
 
-		Vec err = (out - Y[trainingIndex]);
-		Var loss = err * err * (1.0f / static_cast<float>(sequence.size()));
+			for (size_t j = 1; j < X[trainingIndex].size(); ++j) {
+				z = sigmoid(Wz * inputs[j] + Uz * out_prev + bz);
+				r = sigmoid(Wr * inputs[j] + Ur * out_prev + br);
+				h_hat = tanh(Wr * inputs[j] + Uh * hadamard(r, out_prev) + br);
+				out_prev = out_prev - hadamard(out_prev, z) + hadamard(z, h_hat);
+			}
 
+			Vec out = sigmoid(W * out_prev + b);
+
+			Vec err = (out - inputs.back());
+			return err * err * (1.0f / static_cast<float>(X[trainingIndex].size()));
+		});
 
 		loss->calculateDerivatives();
 
-		Wz->value += Wz->partial * lr;
-		Uz->value += Uz->partial * lr;
-		bz->value += bz->partial * lr;
+		update(Wz);
+		update(Uz);
+		update(bz);
 
-		Wr->value += Wr->partial * lr;
-		Ur->value += Ur->partial * lr;
-		br->value += br->partial * lr;
+		update(Wr);
+		update(Ur);
+		update(br);
 
-		Wh->value += Wh->partial * lr;
-		Uh->value += Uh->partial * lr;
-		bh->value += bh->partial * lr;
+		update(Wh);
+		update(Uh);
+		update(bh);
 
-		W->value += W->partial * lr;
-		b->value += b->partial * lr;
+		update(W);
+		update(b);
 	}
 
 
+	// only evaluating from here, no need for partials
+	InferenceMode inference;
+
 	float l = 0.0f;
 	for (size_t i = 0; i < sequences.size(); ++i) {
 		vector<Vec> sequence = sequences[i];
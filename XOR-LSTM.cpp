@@ -1,5 +1,6 @@
 
 #include "operations.hpp"
+#include "capture.hpp"
 #include "../rng.h"
 
 #include <iostream>
@@ -46,71 +47,92 @@ int main() {
 	vector<vector<Vec>> sequences(X.size(), vector<Vec>(X[0].size()));
 	for (size_t i = 0; i < X.size(); ++i) {
 		for (size_t j = 0; j < X[0].size(); ++j) {
-			sequences[i][j] = Vector::build(1, X[i][j]);
+			sequences[i][j] = Vector::constant(1, X[i][j]);
 		}
 	}
 
 	vector<Vec> Y = {
-		Vector::build(1, 0.0f),
-		Vector::build(1, 1.0f),
-		Vector::build(1, 1.0f),
-		Vector::build(1, 0.0f)
+		Vector::constant(1, 0.0f),
+		Vector::constant(1, 1.0f),
+		Vector::constant(1, 1.0f),
+		Vector::constant(1, 0.0f)
 	};
 
 
+	// every sequence has the same length, so the graph is only built for the first one
+	GraphCapture capture;
+
 	float lr = -0.05f;
+	auto update = [&](auto& param) {
+		param->value += param->partial * lr;
+		param->markDirty();
+	};
+
 	for (int iter = 0; iter < 5000; ++iter) {
 
+		// only the partials of the weights are read, the ones of the unrolled cells can share their memory
+		BufferPool::Scope pool;
+
 		size_t trainingIndex = iter % sequences.size();
-		vector<Vec> sequence = sequences[trainingIndex];
 
-		Vec f;
-		Vec i = sigmoid(Wi * sequence[0] + bi);
-		Vec o = sigmoid(Wo * sequence[0] + bo);
-		Vec c_hat = tanh(Wc * sequence[0] + bc);
+		// one input per element of the sequence, and the target
+		vector<vector<NUM_TYPE>> data;
+		for (size_t j = 0; j < X[trainingIndex].size(); ++j) {
+			data.push_back({ X[trainingIndex][j] });
+		}
+		data.push_back(Y[trainingIndex]->value);
 
-		Vec c_prev = hadamard(i, c_hat);
-		Vec out_prev = hadamard(o, tanh(c_prev));
+		Var loss = capture.replay(data, [&](const vector<Vec>& inputs) {
+			Vec f;
+			Vec i = sigmoid(Wi * inputs[0] + bi);
+			Vec o = sigmoid(Wo * inputs[0] + bo);
+			Vec c_hat = tanh(Wc * inputs[0] + bc);
 
-		for (size_t j = 1; j < sequence.size(); ++j) {
-			f = sigmoid(Wf * sequence[j] + Uf * out_prev + bf);
-			i = sigmoid(Wi * sequence[j] + Ui * out_prev + bi);
-			o = sigmoid(Wo * sequence[j] + Uo * out_prev + bo);
-			c_hat = tanh(Wc * sequence[j] + Uc * out_prev + bc);
+			Vec c_prev = hadamard(i, c_hat);
+			Vec out_prev = hadamard(o, tanh(c_prev));
 
-			c_prev = hadamard(f, c_prev) + hadamard(i, c_hat);
-			out_prev = hadamard(o, tanh(c_prev));
-		}
+			for (size_t j = 1; j < X[trainingIndex].size(); ++j) {
+				f = sigmoid(Wf * inputs[j] + Uf * out_prev + bf);
+				i = sigmoid(Wi * inputs[j] + Ui * out_prev + bi);
+				o = sigmoid(Wo * inputs[j] + Uo * out_prev + bo);
+				c_hat = tanh(Wc * inputs[j] + Uc * out_prev + bc);
 
-		Vec out = sigmoid(W * out_prev + b);
+				c_prev = hadamard(f, c_prev) + hadamard(i, c_hat);
+				out_prev = hadamard(o, tanh(c_prev));
+			}
 
-		Vec err = (out - Y[trainingIndex]);
-		Var loss = err * err * (1.0f / static_cast<float>(sequence.size()));
+			Vec out = sigmoid(W * out_prev + b);
 
+			Vec err = (out - inputs.back());
+			return err * err * (1.0f / static_cast<float>(X[trainingIndex].size()));
+		});
 
 		loss->calculateDerivatives();
 
-		Wf->value += Wf->partial * lr;
-		Uf->value += Uf->partial * lr;
-		bf->value += bf->partial * lr;
+		update(Wf);
+		update(Uf);
+		update(bf);
 
-		Wi->value += Wi->partial * lr;
-		Ui->value += Ui->partial * lr;
-		bi->value += bi->partial * lr;
+		update(Wi);
+		update(Ui);
+		update(bi);
 
-		Wo->value += Wo->partial * lr;
-		Uo->value += Uo->partial * lr;
-		bo->value += bo->partial * lr;
+		update(Wo);
+		update(Uo);
+		update(bo);
 
-		Wc->value += Wc->partial * lr;
-		Uc->value += Uc->partial * lr;
-		bc->value += bc->partial * lr;
+		update(Wc);
+		update(Uc);
+		update(bc);
 
-		W->value += W->partial * lr;
-		b->value += b->partial * lr;
+		update(W);
+		update(b);
 	}
 
 
+	// only evaluating from here, no need for partials
+	InferenceMode inference;
+
 	float l = 0.0f;
 	for (size_t j = 0; j < sequences.size(); ++j) {
 		vector<Vec> sequence = sequences[j];
@@ -0,0 +1,202 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include "scalar.hpp"
+#include "vector.hpp"
+#include "matrix.hpp"
+#include "operations.hpp"
+
+#include <unordered_map>
+#include <list>
+#include <functional>
+
+
+
+#ifndef NUM_TYPE
+#define NUM_TYPE NUM_TYPE
+#endif
+
+
+// records the graph a function builds from some inputs the first time, and replays it for every later call with
+// inputs of the same sizes: the new values are copied into the input leaves of the recorded graph and the same output
+// is returned, so nothing is built again and the execution plan of the output is kept too. For training loops that
+// build the same graph for different data on every iteration.
+// The graph can only depend on the data through the inputs it's given, anything else it reads (the weights, ...) is
+// part of the recording. Those have to be marked dirty when they change (see Node::markDirty), like for any graph that
+// is evaluated more than once. Use one GraphCapture for each place a graph is built.
+// With capacity, only that many graphs are kept, the one used the longest time ago is dropped to make room
+struct GraphCapture {
+
+	// the kind of replay, the number of inputs and the size of each of them
+	using Signature = std::vector<size_t>;
+
+	struct SignatureHash {
+		size_t operator () (const Signature& signature) const {
+			size_t h = signature.size();
+			for (size_t s : signature) {
+				h ^= s + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+			}
+
+			return h;
+		}
+	};
+
+	struct Graph {
+		std::vector<Vec> inputs;
+		std::shared_ptr<Node> output;
+		std::list<Signature>::iterator use;
+	};
+
+	// by shape signature (see signature)
+	std::unordered_map<Signature, Graph, SignatureHash> graphs;
+	std::list<Signature> uses; // the most recently used first
+
+	size_t capacity;
+
+	// what length a sequence of the given length is padded to for replaySequence, so sequences of different lengths
+	// share a graph. The exact length if there isn't one
+	std::function<size_t(size_t)> bucketing;
+
+	size_t hits = 0, misses = 0;
+
+	GraphCapture(size_t c = 0, const std::function<size_t(size_t)>& b = nullptr) : capacity(c), bucketing(b) {}
+
+
+	// some bucketing policies
+	static size_t nextPowerOfTwo(size_t length) {
+		size_t bucket = 1;
+		while (bucket < length) bucket *= 2;
+
+		return bucket;
+	}
+
+	static std::function<size_t(size_t)> multiplesOf(size_t n) {
+		return [n](size_t length) { return (length + n - 1) / n * n; };
+	}
+
+
+	static Signature signature(size_t kind, const std::vector<std::vector<NUM_TYPE>>& data) {
+		Signature key = { kind, data.size() };
+
+		for (size_t i = 0; i < data.size(); ++i) {
+			key.push_back(data[i].size());
+		}
+
+		return key;
+	}
+
+	// only the inputs that changed are marked dirty, so the parts of the graph that only depend on the others
+	// aren't evaluated again
+	static void bind(Graph& graph, const std::vector<std::vector<NUM_TYPE>>& data) {
+		for (size_t i = 0; i < data.size(); ++i) {
+			if (graph.inputs[i]->value != data[i]) {
+				graph.inputs[i]->value = data[i];
+				graph.inputs[i]->markDirty();
+			}
+		}
+	}
+
+	Graph* find(const Signature& key) {
+		auto it = graphs.find(key);
+
+		if (it == graphs.end()) {
+			++misses;
+			return nullptr;
+		}
+
+		++hits;
+		uses.splice(uses.begin(), uses, it->second.use);
+
+		return &it->second;
+	}
+
+	// build gets the leaves, already holding the data
+	template <typename F>
+	Graph& record(const Signature& key, const std::vector<std::vector<NUM_TYPE>>& data, F build) {
+		while (capacity && graphs.size() >= capacity) {
+			graphs.erase(uses.back());
+			uses.pop_back();
+		}
+
+		Graph graph;
+		for (size_t i = 0; i < data.size(); ++i) {
+			graph.inputs.push_back(Vector::build(data[i].size()));
+			graph.inputs[i]->value = data[i];
+		}
+
+		graph.output = build(graph.inputs);
+
+		uses.push_front(key);
+		graph.use = uses.begin();
+
+		return graphs.emplace(key, graph).first->second;
+	}
+
+	// build gets a leaf for each vector of data and returns the output, a Var, Vec or Mat
+	template <typename F>
+	auto replay(const std::vector<std::vector<NUM_TYPE>>& data, F build) -> decltype(build(std::vector<Vec>())) {
+		using Output = decltype(build(std::vector<Vec>()));
+
+		Signature key = signature(0, data);
+
+		if (Graph* graph = find(key)) {
+			bind(*graph, data);
+			return Output(graph->output);
+		}
+
+		return Output(record(key, data, build).output);
+	}
+
+	// for sequences of different lengths. The steps (all of the same size) are padded with zeros up to the length the
+	// bucketing gives, build gets a leaf for each of them, a mask with a 1 for each real step and a 0 for each padding
+	// step, and a leaf for each of the other inputs. The graph has to use the mask so the padding steps don't change
+	// the output, like only updating the state of a recurrent layer where the mask is 1
+	template <typename F>
+	auto replaySequence(const std::vector<std::vector<NUM_TYPE>>& steps, const std::vector<std::vector<NUM_TYPE>>& others, F build)
+		-> decltype(build(std::vector<Vec>(), Vec(), std::vector<Vec>())) {
+
+		using Output = decltype(build(std::vector<Vec>(), Vec(), std::vector<Vec>()));
+
+		if (steps.empty()) {
+			throw std::runtime_error("Cannot replay an empty sequence");
+		}
+
+		size_t length = bucketing ? bucketing(steps.size()) : steps.size();
+		if (length < steps.size()) {
+			throw std::runtime_error("The bucketing can't make a sequence shorter");
+		}
+
+		// the steps, then the others, then the mask
+		std::vector<std::vector<NUM_TYPE>> data(steps);
+		data.resize(length, std::vector<NUM_TYPE>(steps[0].size(), 0.0f));
+		data.insert(data.end(), others.begin(), others.end());
+
+		std::vector<NUM_TYPE> mask(length, 0.0f);
+		std::fill(mask.begin(), mask.begin() + steps.size(), 1.0f);
+		data.push_back(mask);
+
+		Signature key = signature(1, data);
+
+		if (Graph* graph = find(key)) {
+			bind(*graph, data);
+			return Output(graph->output);
+		}
+
+		Graph& graph = record(key, data, [&](const std::vector<Vec>& inputs) {
+			std::vector<Vec> stepInputs(inputs.begin(), inputs.begin() + length);
+			std::vector<Vec> otherInputs(inputs.begin() + length, inputs.end() - 1);
+
+			return build(stepInputs, inputs.back(), otherInputs);
+		});
+
+		return Output(graph.output);
+	}
+
+	void clear() {
+		graphs.clear();
+		uses.clear();
+	}
+};
+
+
+#endif
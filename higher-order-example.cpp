@@ -43,7 +43,7 @@ int main() {
 
 	// compare with finite-difference just to be shure (it does struggle with precision)
 	for (float i = -5.0f; i <= 5.0f; i += 0.1f) {
-		x->value = i;
+		x->set(i);
 
 		f->eval();
 		grad->eval();
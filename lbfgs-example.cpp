@@ -0,0 +1,77 @@
+#include "operations.hpp"
+#include "optimizer.hpp"
+
+#include <iostream>
+
+using namespace std;
+
+
+// the rosenbrock function, a narrow curved valley with the minimum at (1, 1). The line search has to shorten (zoom)
+// a lot of the steps on the way there
+bool rosenbrock() {
+	Var a = Scalar::build(-1.2f, true), b = Scalar::build(1.0f, true);
+	Var f = (1.0f - a) * (1.0f - a) + 100.0f * (b - a * a) * (b - a * a);
+
+	LBFGS optimizer(f, 8);
+	NUM_TYPE value = optimizer.minimize(200, true);
+
+	cout << "Rosenbrock: " << value << " at (" << a->value << ", " << b->value << ") after " << optimizer.iterations
+		<< " iterations and " << optimizer.evaluations << " evaluations\n";
+
+	return std::abs(a->value - 1.0f) < 1e-3f && std::abs(b->value - 1.0f) < 1e-3f && optimizer.evaluations > optimizer.iterations + 1;
+}
+
+// fitting y = 1.2 * exp(0.5 * x) to noisy points, the same problem as nonlinear-least-squares.cpp
+bool curveFit() {
+	Vec params = Vector::build(2, 0.0f, true); params->value = { 1.9f, -0.1f };
+	Var loss;
+
+	size_t k = 0;
+	for (float x = -10.0f; x <= 5.0f; x += 0.1f, ++k) {
+		float y = 1.2f * std::exp(0.5f * x) + 0.3f * std::sin(7.0f * x);
+		Var r = params->get(0) * Exp::build(params->get(1) * x) + -y;
+
+		loss = k ? loss + r * r : r * r;
+	}
+
+	LBFGS optimizer(loss);
+	NUM_TYPE value = optimizer.minimize(100);
+
+	cout << "Curve fit: " << value << " with params " << params->value << " after " << optimizer.iterations << " iterations\n";
+
+	return std::abs(params->value[0] - 1.2f) < 0.05f && std::abs(params->value[1] - 0.5f) < 0.01f;
+}
+
+// a history pair with negative curvature (the kind rounding can let through) makes the first direction go uphill,
+// so minimize has to throw the history away and start over from the gradient
+bool badHistory() {
+	Vec x = Vector::build(2, 0.0f, true);
+	Vec target = Vector::constant(2, 0.0f); target->value = { 3.0f, -2.0f };
+
+	Vec e = x - target;
+	Var f = e * e;
+
+	LBFGS optimizer(f, 4);
+	optimizer.s[0] = { 1.0f, 0.0f };
+	optimizer.y[0] = { -1.0f, 0.0f };
+	optimizer.rho[0] = -1.0;
+	optimizer.count = 1;
+
+	NUM_TYPE value = optimizer.minimize(20);
+
+	cout << "Bad history: " << value << " at " << x->value << " after " << optimizer.restarts << " restart\n";
+
+	return optimizer.restarts == 1 && value < 1e-8f;
+}
+
+
+int main() {
+
+	bool ok = rosenbrock();
+	ok = curveFit() && ok;
+	ok = badHistory() && ok;
+
+	cout << (ok ? "L-BFGS ok" : "L-BFGS FAILED") << "\n";
+
+	return ok ? 0 : 1;
+}
@@ -118,11 +118,14 @@ struct Matrix : Node {
 
 	size_t rows, cols;
 	std::vector<std::vector<NUM_TYPE>> value;
-	std::vector<std::vector<NUM_TYPE>> partial;
+	std::vector<std::vector<NUM_TYPE>> partial; // see Vector::partial
 	std::shared_ptr<Matrix> gradientFunction;
 
-	Matrix(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f, const std::string& n = "", bool trainable = false) : rows(r), cols(c), 
-		value(std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue))), partial(std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f))) {
+	Matrix(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f, const std::string& n = "", bool trainable = false) : rows(r), cols(c), value(r) {
+
+		for (size_t i = 0; i < r; ++i) {
+			value[i] = BufferPool::filled(c, fillValue);
+		}
 
 		#if USE_NAME
 			name = n;
@@ -131,13 +134,87 @@ struct Matrix : Node {
 		isTrainable = trainable;
 	}
 
+	// see ~Vector
+	~Matrix() {
+		if (!NodeArena::isActive()) return;
+
+		for (size_t i = 0; i < value.size(); ++i) {
+			BufferPool::release(value[i]);
+		}
+
+		for (size_t i = 0; i < partial.size(); ++i) {
+			BufferPool::release(partial[i]);
+		}
+	}
+
 	static std::shared_ptr<Matrix> build(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f, bool trainable = false, const std::string& n = "") {
-		return std::make_shared<Matrix>(r, c, fillValue, n, trainable);
+		return makeLeaf(r, c, fillValue, n, trainable);
+	}
+
+	// see Vector::makeLeaf
+	static std::shared_ptr<Matrix> makeLeaf(size_t r, size_t c, NUM_TYPE fillValue, const std::string& n, bool trainable) {
+		std::shared_ptr<Matrix> node = makeNode<Matrix>(r, c, fillValue, n, trainable);
+
+		if (!InferenceMode::isActive()) {
+			node->partial.resize(r);
+			for (size_t i = 0; i < r; ++i) {
+				node->partial[i] = BufferPool::filled(c, 0.0f);
+			}
+		}
+
+		return node;
+	}
+
+	static std::shared_ptr<Matrix> constant(size_t r, size_t c, NUM_TYPE fillValue = 0.0f) {
+
+		NodeCache::Key key = NodeCache::key<Matrix>(r, c, fillValue);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return std::static_pointer_cast<Matrix>(cached);
+
+		std::shared_ptr<Matrix> node = makeNode<Matrix>(r, c, fillValue);
+		node->isConstant = true;
+		node->requiresGrad = false;
+
+		NodeCache::store(key, node);
+		return node;
+	}
+
+	static std::shared_ptr<Matrix> constant(const std::vector<std::vector<NUM_TYPE>>& m) {
+		std::shared_ptr<Matrix> node = makeNode<Matrix>(m.size(), m.size() ? m[0].size() : 0);
+		node->value = m;
+		node->isConstant = true;
+		node->requiresGrad = false;
+
+		return node;
+	}
+
+	// an operation on constants is a constant, so evaluate it right away and let go of it's parents
+	static Mat fold(const std::shared_ptr<Matrix>& node);
+
+	bool isConstantEqualTo(NUM_TYPE v) const {
+		if (!isConstant) return false;
+
+		for (size_t i = 0; i < rows; ++i) {
+			for (size_t j = 0; j < cols; ++j) {
+				if (value[i][j] != v) return false;
+			}
+		}
+
+		return true;
+	}
+
+	// changes the value of a leaf, and marks it dirty so every graph that reads it sees it
+	void set(const std::vector<std::vector<NUM_TYPE>>& m) {
+		if (m.size() != rows || (rows && m[0].size() != cols)) {
+			throw std::runtime_error("Cannot set a " + std::to_string(rows) + "x" + std::to_string(cols) + " matrix to other sizes");
+		}
+
+		value = m;
+		markDirty();
 	}
 
 	static std::shared_ptr<Matrix> makeRandom(size_t r = 0, size_t c = 0, NUM_TYPE mean = 0.0, NUM_TYPE stddev = 1.0, bool trainable = false, const std::string& n = "") {
 
-		std::shared_ptr<Matrix> mat = std::make_shared<Matrix>(r, c, 0.0f, n, trainable);
+		std::shared_ptr<Matrix> mat = makeLeaf(r, c, 0.0f, n, trainable);
 
 		stddev /= static_cast<NUM_TYPE>(c);
 
@@ -159,9 +236,91 @@ struct Matrix : Node {
 	}
 
 	void resetPartial(NUM_TYPE defaultValue = 0.0f) override final {
+		partial.resize(rows);
 		for (size_t i = 0; i < rows; ++i) {
+			BufferPool::ensure(partial[i], cols);
 			std::fill(partial[i].begin(), partial[i].end(), defaultValue);
 		}
+
+		hasPartial = true;
+	}
+
+	// see Vector::accumulatePartial
+	template <typename F>
+	void accumulatePartial(F contribution) {
+		if (!hasPartial) {
+			partial.resize(rows);
+			for (size_t i = 0; i < rows; ++i) {
+				BufferPool::ensure(partial[i], cols);
+				for (size_t j = 0; j < cols; ++j) {
+					partial[i][j] = contribution(i, j);
+				}
+			}
+
+			hasPartial = true;
+			return;
+		}
+
+		for (size_t i = 0; i < rows; ++i) {
+			for (size_t j = 0; j < cols; ++j) {
+				partial[i][j] += contribution(i, j);
+			}
+		}
+	}
+
+	void accumulatePartial(const std::vector<std::vector<NUM_TYPE>>& contribution) {
+		accumulatePartial([&](size_t i, size_t j) { return contribution[i][j]; });
+	}
+
+	std::vector<std::vector<NUM_TYPE>>& touchPartial() {
+		if (!hasPartial) resetPartial();
+		return partial;
+	}
+
+	// the rows go to the pool one by one
+	void releasePartial() override final {
+		for (size_t i = 0; i < partial.size(); ++i) {
+			BufferPool::release(partial[i]);
+		}
+
+		partial.clear();
+		hasPartial = false;
+	}
+
+	void releaseValue() override final {
+		for (size_t i = 0; i < value.size(); ++i) {
+			BufferPool::release(value[i]);
+		}
+
+		value.clear();
+	}
+
+	void acquireValue() override final {
+		if (value.size() == rows) return;
+
+		value.resize(rows);
+		for (size_t i = 0; i < rows; ++i) {
+			BufferPool::ensure(value[i], cols);
+		}
+	}
+
+	// the rows are spilled, the matrix keeps it's shape
+	std::vector<std::vector<NUM_TYPE>*> valueBuffers() override final {
+		std::vector<std::vector<NUM_TYPE>*> buffers(value.size());
+		for (size_t i = 0; i < value.size(); ++i) {
+			buffers[i] = &value[i];
+		}
+
+		return buffers;
+	}
+
+	size_t hashValue() override final {
+		size_t hash = value.size();
+		for (size_t i = 0; i < value.size(); ++i) {
+			hash = hashValues(value[i], hash);
+		}
+
+		return hash;
 	}
 
 	NodeTypes getType() {
@@ -173,7 +332,11 @@ struct Matrix : Node {
 	}
 
 	void resetGradientFunction(NUM_TYPE defaultValue = 0.0f) override {
-		gradientFunction = Matrix::build(rows, cols, defaultValue);
+		gradientFunction = Matrix::constant(rows, cols, defaultValue);
+	}
+
+	bool isGradientFunctionZero() override final {
+		return gradientFunction && gradientFunction->isConstantEqualTo(0.0f);
 	}
 
 
@@ -211,7 +374,7 @@ struct Matrix : Node {
 		file.read(reinterpret_cast<char*>(&rows), sizeof(rows));
 		file.read(reinterpret_cast<char*>(&cols), sizeof(cols));
 
-		std::shared_ptr<Matrix> mat = std::make_shared<Matrix>(rows, cols, 0.0f, "", trainable);
+		std::shared_ptr<Matrix> mat = makeLeaf(rows, cols, 0.0f, "", trainable);
 
 		for (size_t i = 0; i < rows; ++i) {
 			file.read(reinterpret_cast<char*>(&mat->value[i][0]), cols * sizeof(NUM_TYPE));
@@ -235,6 +398,14 @@ std::vector<std::vector<NUM_TYPE>> Mat::operator () () const {
 	return ptr->value;
 }
 
+Mat Matrix::fold(const std::shared_ptr<Matrix>& node) {
+	if (!node->hasOnlyConstantParents()) return node;
+
+	node->acquireValue();
+	node->evaluate();
+	return constant(node->value);
+}
+
 
 
 
@@ -248,17 +419,20 @@ struct MatrixAddAtPos : Matrix {
 	Vec b;
 	size_t index;
 
-	MatrixAddAtPos(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f) {
+	MatrixAddAtPos(size_t r = 0, size_t c = 0) {
 		rows = r;
 		cols = c;
-
-		value = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue));
-		partial = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f));
 	}
 
 	static Mat build(const Mat& m, const Vec& v, size_t index = 0) {
 
-		std::shared_ptr<MatrixAddAtPos> node = std::make_shared<MatrixAddAtPos>(m->rows, m->cols);
+		// m[i] + 0 = m
+		if (v->isConstantEqualTo(0.0f)) return m;
+
+		NodeCache::Key key = NodeCache::key<MatrixAddAtPos>(m, v, index);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<MatrixAddAtPos> node = makeNode<MatrixAddAtPos>(m->rows, m->cols);
 
 		node->a = m;
 		node->b = v;
@@ -270,7 +444,7 @@ struct MatrixAddAtPos : Matrix {
 		node->parents.push_back(m);
 		node->parents.push_back(v);
 
-		return node;
+		return NodeCache::insert(key, Matrix::fold(node));
 	}
 
 	void evaluate() override final {
@@ -278,9 +452,13 @@ struct MatrixAddAtPos : Matrix {
 		value[index] += b->value;
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		a->partial += partial;
-		b->partial += partial[index];
+		if (a->requiresGrad) a->accumulatePartial(partial);
+		if (b->requiresGrad) b->accumulatePartial(partial[index]);
 	}
 
 	void updateGradientFunction() override final {
@@ -297,13 +475,14 @@ struct GetMatrixRow : Vector {
 
 	GetMatrixRow(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, 0.0f);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Mat& m, size_t index = 0) {
 
-		std::shared_ptr<GetMatrixRow> node = std::make_shared<GetMatrixRow>(m->cols);
+		NodeCache::Key key = NodeCache::key<GetMatrixRow>(m, index);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<GetMatrixRow> node = makeNode<GetMatrixRow>(m->cols);
 
 		node->a = m;
 		node->index = index;
@@ -313,15 +492,19 @@ struct GetMatrixRow : Vector {
 
 		node->parents.push_back(m);
 
-		return node;
+		return NodeCache::insert(key, Vector::fold(node));
 	}
 
 	void evaluate() override final {
 		value = a->value[index];
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		a->partial[index] += partial;
+		a->touchPartial()[index] += partial;
 	}
 
 	void updateGradientFunction() override final {
@@ -343,23 +526,19 @@ Vec Mat::operator [] (size_t index) const {
 struct MatrixFromVectors : Matrix {
 	std::vector<Vec> a;
 
-	MatrixFromVectors(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f) {
+	MatrixFromVectors(size_t r = 0, size_t c = 0) {
 		rows = r;
 		cols = c;
-
-		value = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue));
-		partial = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f));
 	}
 
 
 	static Mat build(const std::vector<Vec>& vecs) {
 
-		std::shared_ptr<MatrixFromVectors> node = std::make_shared<MatrixFromVectors>(vecs.size(), vecs[0]->size);
+		std::shared_ptr<MatrixFromVectors> node = makeNode<MatrixFromVectors>(vecs.size(), vecs[0]->size);
 
 		node->a = vecs;
 		for (size_t i = 0; i < vecs.size(); ++i) {
 			node->parents.push_back(vecs[i]);
-			node->value[i] = vecs[i]->value;
 		}
 
 		return node;
@@ -371,9 +550,13 @@ struct MatrixFromVectors : Matrix {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
 		for (size_t i = 0; i < rows; ++i) {
-			a[i]->partial += partial[i];
+			if (a[i]->requiresGrad) a[i]->accumulatePartial(partial[i]);
 		}
 	}
 
@@ -0,0 +1,731 @@
+#ifndef MEMORY_HPP
+#define MEMORY_HPP
+
+#include <vector>
+#include <unordered_map>
+#include <deque>
+#include <string>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+
+#ifndef NUM_TYPE
+#define NUM_TYPE NUM_TYPE
+#endif
+
+
+// replacing the global operator new has to be done in only one file of the program, so allocations are only counted
+// where COUNT_ALLOCATIONS is true (defined before including anything, in the file with main)
+#ifndef COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS false
+#endif
+
+
+// how many times the global operator new was called, to check that a training loop doesn't allocate anymore once it's
+// warmed up (every std::vector, node, plan, ... goes through it). Always 0 without COUNT_ALLOCATIONS
+struct AllocationCounter {
+	static inline std::atomic<size_t> count{0};
+	static inline std::atomic<size_t> bytes{0};
+
+	static size_t get() {
+		return count.load(std::memory_order_relaxed);
+	}
+
+	static void add(size_t size) {
+		count.fetch_add(1, std::memory_order_relaxed);
+		bytes.fetch_add(size, std::memory_order_relaxed);
+	}
+};
+
+// throws if something was allocated between it's construction and check(), see AllocationCounter
+struct AllocationCheck {
+	size_t start;
+
+	AllocationCheck() : start(AllocationCounter::get()) {}
+
+	size_t allocations() const {
+		return AllocationCounter::get() - start;
+	}
+
+	// what is a C string so making the message doesn't count
+	void check(const char* what) const {
+		size_t n = allocations();
+
+		if (n) {
+			throw std::runtime_error(std::string(what) + " allocated memory " + std::to_string(n) + " times");
+		}
+	}
+};
+
+#if COUNT_ALLOCATIONS
+
+	// gcc sees the free of a pointer that came from operator new once they're inlined, they're the same malloc here
+	#if defined(__GNUC__) && !defined(__clang__)
+		#pragma GCC diagnostic push
+		#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+	#endif
+
+	void* operator new(size_t size) {
+		AllocationCounter::add(size);
+
+		void* p = std::malloc(size ? size : 1);
+		if (!p) throw std::bad_alloc();
+
+		return p;
+	}
+	void* operator new[](size_t size) {
+		return operator new(size);
+	}
+	void operator delete(void* p) noexcept {
+		std::free(p);
+	}
+	void operator delete[](void* p) noexcept {
+		std::free(p);
+	}
+	void operator delete(void* p, size_t) noexcept {
+		std::free(p);
+	}
+	void operator delete[](void* p, size_t) noexcept {
+		std::free(p);
+	}
+
+	#if defined(__GNUC__) && !defined(__clang__)
+		#pragma GCC diagnostic pop
+	#endif
+#endif
+
+
+// buffers given back by nodes that won't need them anymore, to be reused by the next nodes that need one of the
+// same size class. Only used while a BufferPool::Scope is alive, then:
+// - the backward pass gives the partial of an operation back as soon as it has been propagated to it's parents, and the
+//   partials of the parents are taken from here, so a partial only lives from it's first contribution to it's own derive
+// - the values of operations are given back once the last node that reads them in the forward pass is evaluated, if
+//   the backward pass won't read them (see Node::deriveReads), or else once the operation has been derived. In
+//   inference mode eval() gives them all back once the forward pass is done with them
+// - the Vector and Matrix constructors take their buffers from here, and give them back when the node is destroyed
+//   while a NodeArena is active
+// so the memory used is about the biggest set of buffers alive at the same time instead of the sum of all of them.
+// Only the partials of the leaves and of the node being derived are kept, the value of the intermediate nodes are
+// recalculated by the next eval() if they were given back.
+// Sizes are rounded up to a size class in bytes (4 steps between 2 powers of 2, so at most a quarter is wasted) and
+// any buffer of a class can be resized to any size of it without reallocating, so buffers of close sizes are shared
+// too. Each thread keeps it's own buffers, so the nodes evaluated or derived by several threads don't need a lock.
+// Once the graphs of a training loop have been through an iteration with the pool active, the next ones find all the
+// buffers they need here (see getStats)
+struct BufferPool {
+
+	static constexpr size_t minClassBytes = 64;
+	static constexpr size_t classCount = 4 * 64;
+
+	struct Cache {
+		std::vector<std::vector<std::vector<NUM_TYPE>>> classes = std::vector<std::vector<std::vector<NUM_TYPE>>>(classCount);
+		size_t generation = 0;
+	};
+
+	struct Stats {
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t released = 0;
+	};
+
+	static inline int activeScopes = 0;
+	// bumped when the last scope ends, so each thread drops it's buffers the next time it uses the pool
+	static inline std::atomic<size_t> generation{0};
+	static inline std::atomic<size_t> hits{0}, misses{0}, released{0};
+
+	// the buffers from this size up are backed by huge pages if the system allows it, so big vectors (or matrices with
+	// big rows, each row is a buffer) need less TLB entries. 0 to never ask for them
+	static inline size_t hugePageBytes = size_t(2) << 20;
+
+	struct Scope {
+		Scope() { ++activeScopes; }
+
+		// the buffers are only kept while someone might want them
+		~Scope() {
+			if (--activeScopes == 0) {
+				++generation;
+				getCache();
+			}
+		}
+
+		Scope(const Scope&) = delete;
+		Scope& operator = (const Scope&) = delete;
+	};
+
+	static bool isActive() {
+		return activeScopes > 0;
+	}
+
+	static Cache& getCache() {
+		thread_local Cache cache;
+
+		size_t current = generation.load(std::memory_order_relaxed);
+		if (cache.generation != current) {
+			for (auto& buffers : cache.classes) {
+				buffers.clear();
+			}
+			cache.generation = current;
+		}
+
+		return cache;
+	}
+
+	static Stats getStats() {
+		Stats stats;
+		stats.hits = hits.load(std::memory_order_relaxed);
+		stats.misses = misses.load(std::memory_order_relaxed);
+		stats.released = released.load(std::memory_order_relaxed);
+
+		return stats;
+	}
+
+	static void resetStats() {
+		hits = 0;
+		misses = 0;
+		released = 0;
+	}
+
+	static size_t classBytes(size_t index) {
+		size_t base = minClassBytes << (index / 4);
+		return base + base / 4 * (index % 4);
+	}
+
+	// the smallest class that holds the given bytes
+	static size_t classAbove(size_t bytes) {
+		if (bytes <= minClassBytes) return 0;
+
+		size_t power = highestBit(bytes - 1);
+		size_t base = size_t(1) << power;
+
+		return (power - highestBit(minClassBytes)) * 4 + (bytes - 1 - base) / (base / 4) + 1;
+	}
+
+	// the biggest class that fits in the given bytes, classCount if there's none
+	static size_t classBelow(size_t bytes) {
+		if (bytes < minClassBytes) return classCount;
+
+		size_t power = highestBit(bytes);
+		size_t base = size_t(1) << power;
+
+		return (power - highestBit(minClassBytes)) * 4 + (bytes - base) / (base / 4);
+	}
+
+	static size_t highestBit(size_t n) {
+		return sizeof(size_t) * 8 - 1 - __builtin_clzl(n);
+	}
+
+	// large blocks from malloc are mapped on their own, so the pages inside them can be given to the kernel as
+	// candidates for transparent huge pages
+	static void adviseHugePages(std::vector<NUM_TYPE>& buffer) {
+#ifdef MADV_HUGEPAGE
+		size_t bytes = buffer.capacity() * sizeof(NUM_TYPE);
+		if (!hugePageBytes || bytes < hugePageBytes) return;
+
+		uintptr_t start = (reinterpret_cast<uintptr_t>(buffer.data()) + hugePageBytes - 1) / hugePageBytes * hugePageBytes;
+		uintptr_t end = (reinterpret_cast<uintptr_t>(buffer.data()) + bytes) / hugePageBytes * hugePageBytes;
+
+		if (end > start) {
+			madvise(reinterpret_cast<void*>(start), end - start, MADV_HUGEPAGE);
+		}
+#else
+		(void)buffer;
+#endif
+	}
+
+	// a buffer of the given size, with whatever was in it before
+	static std::vector<NUM_TYPE> acquire(size_t size) {
+		if (!isActive() || !size) {
+			return std::vector<NUM_TYPE>(size);
+		}
+
+		size_t index = classAbove(size * sizeof(NUM_TYPE));
+		std::vector<std::vector<NUM_TYPE>>& buffers = getCache().classes[index];
+
+		if (buffers.empty()) {
+			misses.fetch_add(1, std::memory_order_relaxed);
+
+			std::vector<NUM_TYPE> buffer;
+			buffer.reserve(classBytes(index) / sizeof(NUM_TYPE));
+			buffer.resize(size);
+			adviseHugePages(buffer);
+
+			return buffer;
+		}
+
+		hits.fetch_add(1, std::memory_order_relaxed);
+
+		std::vector<NUM_TYPE> buffer = std::move(buffers.back());
+		buffers.pop_back();
+		buffer.resize(size);
+
+		return buffer;
+	}
+
+	// a buffer of the given size full of v
+	static std::vector<NUM_TYPE> filled(size_t size, NUM_TYPE v) {
+		std::vector<NUM_TYPE> buffer = acquire(size);
+		std::fill(buffer.begin(), buffer.end(), v);
+
+		return buffer;
+	}
+
+	// leaves the buffer empty. It goes to the class it can hold all of, buffers that didn't come from the pool too
+	static void release(std::vector<NUM_TYPE>& buffer) {
+		if (isActive() && buffer.capacity()) {
+			size_t index = classBelow(buffer.capacity() * sizeof(NUM_TYPE));
+
+			if (index < classCount) {
+				released.fetch_add(1, std::memory_order_relaxed);
+				getCache().classes[index].push_back(std::move(buffer));
+			}
+		}
+
+		buffer = std::vector<NUM_TYPE>();
+	}
+
+	// makes sure the buffer has the given size, taking it from the pool if it can't hold it
+	static void ensure(std::vector<NUM_TYPE>& buffer, size_t size) {
+		if (buffer.size() == size) return;
+
+		if (isActive() && buffer.capacity() < size) {
+			release(buffer);
+			buffer = acquire(size);
+		} else {
+			buffer.resize(size);
+		}
+	}
+};
+
+
+
+
+// a scratch file on disk, mapped in memory, for the buffers that don't fit in it. Buffers are spilled (copied to
+// the file and released) by the main thread. Prefetching them has a background thread read their pages from the disk,
+// so that overlaps with whatever the main thread is doing, and restoring them is just copying them back to buffers
+// from the BufferPool. The file is deleted as soon as it's opened, the space is freed when it's closed or reset
+struct SpillFile {
+
+	struct Record {
+		size_t offset;
+		size_t end;
+		std::vector<size_t> sizes;
+		size_t neededAt; // see prefetchFrom
+
+		enum { SPILLED, QUEUED, READY, RESTORED } state = SPILLED;
+	};
+
+	int file = -1;
+	char* mapping = nullptr;
+	size_t capacity;
+	size_t fileSize = 0;
+	size_t used = 0;
+	size_t spilledBytes = 0; // in total, reset doesn't change it
+
+	// a deque so the references the worker holds stay valid while records are added
+	std::deque<Record> records;
+	std::vector<size_t> schedule;
+	size_t scheduled = 0;
+	bool isScheduleSorted = true;
+
+	std::deque<size_t> queue;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	bool isBusy = false;
+	bool isStopping = false;
+	std::thread worker;
+
+	// the whole capacity is mapped up front (it's only address space), and the file grows as needed, so the mapping
+	// never moves while the worker reads from it
+	SpillFile(const std::string& path, size_t maxBytes) : capacity(maxBytes) {
+		file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (file < 0) {
+			throw std::runtime_error("Cannot open the spill file " + path);
+		}
+
+		unlink(path.c_str());
+
+		void* m = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		if (m == MAP_FAILED) {
+			close(file);
+			throw std::runtime_error("Cannot map the spill file " + path);
+		}
+
+		mapping = static_cast<char*>(m);
+		worker = std::thread([this]() { run(); });
+	}
+
+	~SpillFile() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isStopping = true;
+		}
+
+		wake.notify_all();
+		worker.join();
+
+		munmap(mapping, capacity);
+		close(file);
+	}
+
+	SpillFile(const SpillFile&) = delete;
+	SpillFile& operator = (const SpillFile&) = delete;
+
+	// copies the buffers to the file and releases them. neededAt is what prefetchFrom compares to
+	size_t spill(const std::vector<std::vector<NUM_TYPE>*>& buffers, size_t neededAt) {
+		Record record;
+		record.offset = (used + 63) / 64 * 64;
+		record.neededAt = neededAt;
+
+		size_t end = record.offset;
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			end += buffers[i]->size() * sizeof(NUM_TYPE);
+		}
+
+		if (end > capacity) {
+			throw std::runtime_error("The spill file is full");
+		}
+
+		if (end > fileSize) {
+			fileSize = std::min(capacity, std::max(end, std::max(fileSize * 2, (size_t) 1 << 20)));
+			if (ftruncate(file, fileSize) != 0) {
+				throw std::runtime_error("Cannot grow the spill file");
+			}
+		}
+
+		size_t position = record.offset;
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			size_t bytes = buffers[i]->size() * sizeof(NUM_TYPE);
+
+			std::memcpy(mapping + position, buffers[i]->data(), bytes);
+			record.sizes.push_back(buffers[i]->size());
+			BufferPool::release(*buffers[i]);
+
+			position += bytes;
+		}
+
+		record.end = end;
+		used = end;
+		spilledBytes += end - record.offset;
+
+		// start writing it to disk and stop mapping it, so it doesn't count as our memory anymore
+		forget(record.offset, end, true);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		records.push_back(std::move(record));
+		schedule.push_back(records.size() - 1);
+		isScheduleSorted = false;
+
+		return records.size() - 1;
+	}
+
+	// starts reading back every spilled record whose neededAt is at least position, from the biggest neededAt.
+	// Meant to be called with a decreasing position, like the reverse sweep of the backward pass
+	void prefetchFrom(size_t position) {
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (!isScheduleSorted) {
+			std::stable_sort(schedule.begin() + scheduled, schedule.end(), [&](size_t a, size_t b) {
+				return records[a].neededAt > records[b].neededAt;
+			});
+
+			isScheduleSorted = true;
+		}
+
+		bool queued = false;
+		for (; scheduled < schedule.size() && records[schedule[scheduled]].neededAt >= position; ++scheduled) {
+			Record& record = records[schedule[scheduled]];
+
+			if (record.state == Record::SPILLED) {
+				record.state = Record::QUEUED;
+				queue.push_back(schedule[scheduled]);
+				queued = true;
+			}
+		}
+
+		if (queued) wake.notify_one();
+	}
+
+	// copies the record back to the buffers, waiting for the prefetch if it's on it's way
+	void restore(size_t id, const std::vector<std::vector<NUM_TYPE>*>& buffers) {
+		Record* record;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			record = &records[id];
+
+			done.wait(lock, [&]() { return record->state != Record::QUEUED; });
+			record->state = Record::RESTORED;
+		}
+
+		size_t position = record->offset;
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			BufferPool::ensure(*buffers[i], record->sizes[i]);
+			std::memcpy(buffers[i]->data(), mapping + position, record->sizes[i] * sizeof(NUM_TYPE));
+
+			position += record->sizes[i] * sizeof(NUM_TYPE);
+		}
+
+		forget(record->offset, record->end, false);
+	}
+
+	// forgets everything that was spilled, once the worker is done with it
+	void reset() {
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [&]() { return queue.empty() && !isBusy; });
+
+		records.clear();
+		schedule.clear();
+		scheduled = 0;
+		isScheduleSorted = true;
+		used = 0;
+
+		if (fileSize) {
+			forget(0, fileSize, false);
+			fileSize = 0;
+
+			if (ftruncate(file, 0) != 0) {
+				throw std::runtime_error("Cannot shrink the spill file");
+			}
+		}
+	}
+
+	void run() {
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while (true) {
+			wake.wait(lock, [&]() { return isStopping || !queue.empty(); });
+			if (isStopping) return;
+
+			Record& record = records[queue.front()];
+			queue.pop_front();
+			isBusy = true;
+
+			lock.unlock();
+
+			// touching a byte of every page is enough for the kernel to read it
+			size_t page = sysconf(_SC_PAGESIZE);
+			volatile char sink = 0;
+			for (size_t i = record.offset; i < record.end; i += page) {
+				sink = sink + mapping[i];
+			}
+
+			lock.lock();
+			record.state = Record::READY;
+			isBusy = false;
+			done.notify_all();
+		}
+	}
+
+	// unmaps the whole pages in [begin, end) (the data stays in the file)
+	void forget(size_t begin, size_t end, bool writeBack) {
+		size_t page = sysconf(_SC_PAGESIZE);
+		begin = (begin + page - 1) / page * page;
+		end = end / page * page;
+
+		if (begin >= end) return;
+
+		if (writeBack) msync(mapping + begin, end - begin, MS_ASYNC);
+		madvise(mapping + begin, end - begin, MADV_DONTNEED);
+	}
+};
+
+
+
+// while an Offload is alive, the values the backward pass keeps for later (see Node::deriveReads and Checkpointing)
+// are spilled to a SpillFile at path when the first node that reads them in the reverse sweep is more than window nodes
+// away from the end of the plan, and prefetched when the reverse sweep is window nodes away from it. Values smaller
+// than minBytes are left in memory, the file isn't worth it for them
+struct Offload {
+	static inline Offload* active = nullptr;
+
+	SpillFile file;
+	size_t window;
+	size_t minBytes;
+	Offload* previous;
+
+	Offload(const std::string& path, size_t w = 256, size_t minB = 4096, size_t maxBytes = (size_t) 1 << 36)
+		: file(path, maxBytes), window(w), minBytes(minB), previous(active) {
+
+		active = this;
+	}
+
+	~Offload() {
+		active = previous;
+	}
+
+	Offload(const Offload&) = delete;
+	Offload& operator = (const Offload&) = delete;
+
+	static bool isActive() {
+		return active != nullptr;
+	}
+};
+
+
+
+
+// while a NodeArena::Scope is alive, the nodes that are built (see makeNode) are placed one after the other in big
+// chunks of memory instead of each one being a separate allocation, for graphs that are built again on every iteration.
+// A chunk is reused as soon as every node in it is gone, so nodes can outlive the scope (a graph kept for later just
+// keeps it's chunks from being reused), but graphs that are kept for long are better built outside of one.
+// Only the nodes themselves (with their shared_ptr control blocks and the lists of their parents) go here, their buffers
+// are still std::vectors. Those are given back to the BufferPool when the nodes are gone, so with a BufferPool::Scope
+// around the whole loop the next graphs reuse them. Not thread safe, like building graphs
+struct NodeArena {
+
+	// every allocation starts with a pointer to it's chunk (nullptr for the ones that didn't fit in one), padded so
+	// the node keeps the alignment operator new would give it
+	static constexpr size_t headerSize = alignof(std::max_align_t);
+
+	struct Chunk {
+		std::unique_ptr<char[]> data;
+		size_t used = 0;
+		size_t live = 0;
+	};
+
+	static inline size_t chunkSize = 1 << 20;
+	static inline std::vector<std::unique_ptr<Chunk>> chunks;
+	static inline std::vector<Chunk*> spare;
+	static inline Chunk* current = nullptr;
+	static inline int activeScopes = 0;
+
+	struct Scope {
+		Scope() { ++activeScopes; }
+
+		// the chunk being filled is left for the nodes still in it, it'll be reused once they're gone
+		~Scope() {
+			if (--activeScopes == 0 && current) {
+				Chunk* last = current;
+				current = nullptr;
+
+				if (!last->live) recycle(last);
+			}
+		}
+
+		Scope(const Scope&) = delete;
+		Scope& operator = (const Scope&) = delete;
+	};
+
+	static bool isActive() {
+		return activeScopes > 0;
+	}
+
+	static void* allocate(size_t bytes) {
+		size_t size = (headerSize + bytes + headerSize - 1) / headerSize * headerSize;
+
+		if (!isActive() || size > chunkSize) {
+			char* p = static_cast<char*>(::operator new(headerSize + bytes)) + headerSize;
+			reinterpret_cast<Chunk**>(p)[-1] = nullptr;
+			return p;
+		}
+
+		if (!current || current->used + size > chunkSize) {
+			nextChunk();
+		}
+
+		char* p = current->data.get() + current->used + headerSize;
+		reinterpret_cast<Chunk**>(p)[-1] = current;
+
+		current->used += size;
+		++current->live;
+
+		return p;
+	}
+
+	static void deallocate(void* ptr) {
+		char* p = static_cast<char*>(ptr);
+		Chunk* chunk = reinterpret_cast<Chunk**>(p)[-1];
+
+		if (!chunk) {
+			::operator delete(p - headerSize);
+			return;
+		}
+
+		if (--chunk->live) return;
+
+		// the chunk being filled can start over right away
+		if (chunk == current) {
+			chunk->used = 0;
+		} else {
+			recycle(chunk);
+		}
+	}
+
+	static void recycle(Chunk* chunk) {
+		chunk->used = 0;
+		spare.push_back(chunk);
+	}
+
+	static void nextChunk() {
+		Chunk* last = current;
+
+		if (spare.size()) {
+			current = spare.back();
+			spare.pop_back();
+		} else {
+			chunks.push_back(std::make_unique<Chunk>());
+			chunks.back()->data.reset(new char[chunkSize]);
+			current = chunks.back().get();
+		}
+
+		if (last && !last->live) recycle(last);
+	}
+
+	// frees the chunks no node is using
+	static void trim() {
+		for (size_t i = 0; i < spare.size(); ++i) {
+			for (size_t j = 0; j < chunks.size(); ++j) {
+				if (chunks[j].get() == spare[i]) {
+					chunks[j] = std::move(chunks.back());
+					chunks.pop_back();
+					break;
+				}
+			}
+		}
+
+		spare.clear();
+	}
+};
+
+// for std::allocate_shared, see makeNode
+template <typename T>
+struct ArenaAllocator {
+	using value_type = T;
+
+	ArenaAllocator() = default;
+
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>&) {}
+
+	T* allocate(size_t n) {
+		return static_cast<T*>(NodeArena::allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T* p, size_t) {
+		NodeArena::deallocate(p);
+	}
+
+	template <typename U>
+	bool operator == (const ArenaAllocator<U>&) const { return true; }
+
+	template <typename U>
+	bool operator != (const ArenaAllocator<U>&) const { return false; }
+};
+
+
+#endif
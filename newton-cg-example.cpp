@@ -0,0 +1,192 @@
+#include "operations.hpp"
+#include "optimizer.hpp"
+
+#include <iostream>
+
+using namespace std;
+
+
+// the residuals of fitting y = a * exp(b * x) to noisy points, the same problem as nonlinear-least-squares.cpp
+Vec fitResiduals(const Vec& params) {
+	vector<Var> residuals;
+
+	for (float x = -10.0f; x <= 5.0f; x += 0.1f) {
+		float y = 1.2f * std::exp(0.5f * x) + 0.3f * std::sin(7.0f * x);
+		residuals.push_back(params->get(0) * Exp::build(params->get(1) * x) + -y);
+	}
+
+	return VectorFromScalars::build(residuals);
+}
+
+// for results that come from finite differences
+const NUM_TYPE tolerance = 100.0f * std::sqrt(std::numeric_limits<NUM_TYPE>::epsilon());
+
+NUM_TYPE relativeError(const vector<NUM_TYPE>& a, const vector<NUM_TYPE>& b) {
+	double difference = 0.0, size = 0.0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		difference += double(a[i] - b[i]) * (a[i] - b[i]);
+		size += double(b[i]) * b[i];
+	}
+
+	return NUM_TYPE(std::sqrt(difference / size));
+}
+
+// the Gauss-Newton product of the optimizer against 2 * J^T * J * v, with the jacobian from its gradient functions
+bool gaussNewtonProduct() {
+	Vec params = Vector::build(2, 0.0f, true); params->value = { 1.9f, -0.1f };
+	Vec r = fitResiduals(params);
+	Var loss = r * r;
+
+	Mat jacobian = getJacobianFunction(r, params);
+	jacobian->eval();
+
+	vector<NUM_TYPE> v = { 0.3f, -0.7f };
+
+	vector<NUM_TYPE> jv(r->size, 0.0f), expected(v.size(), 0.0f);
+	for (size_t i = 0; i < r->size; ++i) {
+		for (size_t j = 0; j < v.size(); ++j) jv[i] += jacobian->value[i][j] * v[j];
+	}
+	for (size_t j = 0; j < v.size(); ++j) {
+		for (size_t i = 0; i < r->size; ++i) expected[j] += 2.0f * jacobian->value[i][j] * jv[i];
+	}
+
+	bool ok = true;
+
+	for (bool central : { false, true }) {
+		NewtonCG optimizer(loss, r);
+		optimizer.centralDifferences = central;
+		optimizer.minimize(0); // only takes the point and the gradient there
+
+		optimizer.multiply(v);
+		NUM_TYPE error = relativeError(optimizer.product, expected);
+
+		cout << "Gauss-Newton product" << (central ? " (central differences)" : "") << ": " << optimizer.product[0] << ", "
+			<< optimizer.product[1] << " against " << expected[0] << ", " << expected[1] << ", relative error " << error << "\n";
+
+		ok = ok && error < tolerance;
+	}
+
+	return ok;
+}
+
+// the conjugate gradients stop once the newton equations hold to min(0.5, sqrt(|g|)) (relative to |g|), at the border
+// of the trust region if they leave it and right away at the border when the curvature is negative
+bool steihaug() {
+	Vec x = Vector::build(3, 0.0f, true);
+	Mat A = Matrix::constant(3, 3, 0.0f); A->value = { { 4.0f, 1.0f, 0.0f }, { 1.0f, 3.0f, 0.5f }, { 0.0f, 0.5f, 2.0f } };
+	Vec b = Vector::constant(3, 0.0f); b->value = { 1.0f, -2.0f, 3.0f };
+
+	// 1/2 x A x - b x, the minimum where A x = b
+	Var f = 0.5f * (x * (A * x)) - b * x;
+
+	NewtonCG optimizer(f);
+	optimizer.radius = 100.0f;
+	optimizer.minimize(0);
+	optimizer.solveStep();
+
+	// x is 0, so the step is the solution
+	vector<NUM_TYPE> residual(3, 0.0f);
+	for (size_t i = 0; i < 3; ++i) {
+		for (size_t j = 0; j < 3; ++j) residual[i] += A->value[i][j] * optimizer.step[j];
+	}
+
+	NUM_TYPE error = relativeError(residual, b->value);
+	cout << "Newton step: " << optimizer.step << ", relative error of A * step " << error << "\n";
+
+	bool ok = error <= 0.5f;
+
+	optimizer.radius = 0.1f;
+	optimizer.solveStep();
+	NUM_TYPE length = std::sqrt(flatDot(optimizer.step, optimizer.step));
+
+	cout << "Step in a trust region of 0.1: " << length << "\n";
+	ok = ok && std::abs(length - 0.1f) < 1e-4f;
+
+	// and the minimum itself after a few steps
+	optimizer.radius = 100.0f;
+	optimizer.minimize(20);
+	vector<NUM_TYPE> solution = { 15.0f / 28.0f, -8.0f / 7.0f, 25.0f / 14.0f };
+	error = relativeError(x->value, solution);
+
+	cout << "Minimum: " << x->value << " after " << optimizer.iterations << " iterations, relative error " << error << "\n";
+	ok = ok && error < tolerance;
+
+	// a saddle, x^2 - y^2 from (1, 0.5)
+	Vec y = Vector::build(2, 0.0f, true); y->value = { 1.0f, 0.5f };
+	Var saddle = y->get(0) * y->get(0) - y->get(1) * y->get(1);
+
+	NewtonCG saddleOptimizer(saddle);
+	saddleOptimizer.radius = 2.0f;
+	saddleOptimizer.minimize(0);
+	saddleOptimizer.solveStep();
+	length = std::sqrt(flatDot(saddleOptimizer.step, saddleOptimizer.step));
+
+	cout << "Step with negative curvature in a trust region of 2: " << length << "\n";
+
+	return ok && std::abs(length - 2.0f) < 1e-3f;
+}
+
+// the radius shrinks when the model predicts badly (the curved valley of the rosenbrock function) and grows when the
+// steps are good and reach the border (a quadratic started with a tiny region)
+bool trustRegion() {
+	Var a = Scalar::build(-1.2f, true), b = Scalar::build(1.0f, true);
+	Var f = (1.0f - a) * (1.0f - a) + 100.0f * (b - a * a) * (b - a * a);
+
+	NewtonCG optimizer(f);
+	optimizer.centralDifferences = true;
+	optimizer.radius = 100.0f;
+	NUM_TYPE value = optimizer.minimize(200, true);
+
+	cout << "Rosenbrock: " << value << " at (" << a->value << ", " << b->value << ") after " << optimizer.iterations
+		<< " iterations, radius " << optimizer.radius << "\n";
+
+	bool ok = std::abs(a->value - 1.0f) < 1e-3f && std::abs(b->value - 1.0f) < 1e-3f && optimizer.radius < 100.0f;
+
+	Vec x = Vector::build(2, 0.0f, true);
+	Vec target = Vector::constant(2, 0.0f); target->value = { 30.0f, -40.0f };
+	Vec e = x - target;
+	Var quadratic = e * e;
+
+	NewtonCG growing(quadratic);
+	growing.radius = 1e-2f;
+	value = growing.minimize(50);
+
+	cout << "Quadratic from a region of 0.01: " << value << " after " << growing.iterations << " iterations, radius " << growing.radius << "\n";
+
+	return ok && growing.radius > 1.0f && value < 1e-4f;
+}
+
+// newton (finite difference products of the gradient) and Gauss-Newton on the curve fit
+bool curveFit() {
+	bool ok = true;
+
+	for (bool gaussNewton : { false, true }) {
+		Vec params = Vector::build(2, 0.0f, true); params->value = { 1.9f, -0.1f };
+		Vec r = fitResiduals(params);
+		Var loss = r * r;
+
+		NewtonCG optimizer = gaussNewton ? NewtonCG(loss, r) : NewtonCG(loss);
+		optimizer.centralDifferences = true;
+		NUM_TYPE value = optimizer.minimize(100);
+
+		cout << (gaussNewton ? "Gauss-Newton" : "Newton") << " fit: " << value << " with params " << params->value
+			<< " after " << optimizer.iterations << " iterations and " << optimizer.products << " products\n";
+
+		ok = ok && std::abs(params->value[0] - 1.2f) < 0.05f && std::abs(params->value[1] - 0.5f) < 0.01f;
+	}
+
+	return ok;
+}
+
+
+int main() {
+
+	bool ok = gaussNewtonProduct();
+	ok = steihaug() && ok;
+	ok = trustRegion() && ok;
+	ok = curveFit() && ok;
+
+	cout << (ok ? "Newton-CG ok" : "Newton-CG FAILED") << "\n";
+
+	return ok ? 0 : 1;
+}
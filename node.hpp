@@ -7,8 +7,16 @@
 #include <unordered_set>
 #include <functional>
 #include <tuple>
+#include <unordered_map>
+#include <typeinfo>
+#include <cstring>
+#include <stdexcept>
+#include <cmath>
+#include <string_view>
 #include <omp.h>
 
+#include "memory.hpp"
+
 
 
 #ifndef NUM_TYPE
@@ -23,12 +31,273 @@
 #define USE_NAME false
 #endif
 
+// leaves remember a hash of their value each time they're evaluated, and the next evaluation throws if it changed
+// without a markDirty in between (the graphs that were evaluated already wouldn't see the change). It reads every leaf
+// on each evaluation, so it's off with NDEBUG
+#ifndef CHECK_LEAF_WRITES
+	#ifdef NDEBUG
+		#define CHECK_LEAF_WRITES false
+	#else
+		#define CHECK_LEAF_WRITES true
+	#endif
+#endif
+
+
+struct Node;
+
+
+// the hash of a buffer, seed combines it with the ones before it
+inline size_t hashValues(const std::vector<NUM_TYPE>& values, size_t seed = 0) {
+	std::string_view bytes(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(NUM_TYPE));
+	return seed * 31 + std::hash<std::string_view>()(bytes);
+}
+
+
+// how nodes are made, in the NodeArena while a scope of it is alive
+template <typename T, typename... Args>
+std::shared_ptr<T> makeNode(Args&&... args) {
+	if (NodeArena::isActive()) {
+		return std::allocate_shared<T>(ArenaAllocator<T>(), std::forward<Args>(args)...);
+	}
+
+	return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+
+// structural hash-consing. While a NodeCache::Scope is alive, building an operation with the same type, parents
+// and parameters as a node that still exists returns that node instead of a new one. Gradient functions are full
+// of repeated subexpressions (the same cos(x) or the same product showing up in every order), so calculateGradientFunctions
+// opens a scope. Nodes are only referenced weakly here, so the cache never keeps anything alive
+struct NodeCache {
+	using Key = std::vector<size_t>;
+
+	struct KeyHash {
+		size_t operator () (const Key& key) const {
+			size_t h = key.size();
+			for (size_t k : key) {
+				h ^= k + 0x9e3779b97f4a7c15 + (h << 6) + (h >> 2);
+			}
+
+			return h;
+		}
+	};
+
+	static inline std::unordered_map<Key, std::weak_ptr<Node>, KeyHash> table;
+	static inline int activeScopes = 0;
+	static inline size_t nextPurge = 1024;
+
+	struct Scope {
+		Scope() { ++activeScopes; }
+		~Scope() { --activeScopes; }
+
+		Scope(const Scope&) = delete;
+		Scope& operator = (const Scope&) = delete;
+	};
+
+	// only gradient functions are built inside a scope. They're also the only graphs where 0 * x can be folded into
+	// a constant 0: anywhere else x would be dropped from the graph and stop getting a partial
+	static bool isActive() {
+		return activeScopes > 0;
+	}
+
+	static size_t toKey(const std::shared_ptr<Node>& p) {
+		return reinterpret_cast<size_t>(p.get());
+	}
+	static size_t toKey(size_t v) {
+		return v;
+	}
+	static size_t toKey(NUM_TYPE v) {
+		size_t bits = 0;
+		std::memcpy(&bits, &v, sizeof(NUM_TYPE));
+		return bits;
+	}
+
+	// the key is empty when no scope is active, so building graphs normally doesn't pay for any of this
+	template <typename T, typename... Args>
+	static Key key(const Args&... args) {
+		if (!activeScopes) return {};
+
+		Key k = { typeid(T).hash_code() };
+		(k.push_back(toKey(args)), ...);
+
+		return k;
+	}
+
+	static std::shared_ptr<Node> find(const Key& k) {
+		if (k.empty()) return nullptr;
+
+		auto it = table.find(k);
+		return (it == table.end()) ? nullptr : it->second.lock();
+	}
+
+	static void store(const Key& k, const std::shared_ptr<Node>& node) {
+		if (k.empty()) return;
+
+		table[k] = node;
+
+		// forget about nodes that don't exist anymore every once in a while
+		if (table.size() >= nextPurge) {
+			for (auto it = table.begin(); it != table.end();) {
+				it = it->second.expired() ? table.erase(it) : std::next(it);
+			}
+
+			nextPurge = std::max<size_t>(1024, 2 * table.size());
+		}
+	}
+
+	// for operations, works with both shared_ptrs and the Var/Vec/Mat wrappers. If the operation was folded into
+	// a constant it isn't stored, the constant doesn't keep the parents in the key alive and their addresses could
+	// be reused by other nodes (building it again just folds into the same cached constant anyway)
+	template <typename T>
+	static T insert(const Key& k, const T& node);
+};
+
+
+
+// while an InferenceMode is alive nothing can be derived, for when only eval() is needed. Nodes built inside it
+// can still be derived after it's gone (they only get a partial once the backward pass reaches them, leaves too)
+struct InferenceMode {
+	static inline int activeScopes = 0;
+
+	InferenceMode() { ++activeScopes; }
+	~InferenceMode() { --activeScopes; }
+
+	InferenceMode(const InferenceMode&) = delete;
+	InferenceMode& operator = (const InferenceMode&) = delete;
+
+	static bool isActive() {
+		return activeScopes > 0;
+	}
+};
+
+
+
+// while a Checkpointing is alive, the backward pass splits the graph in about sqrt(N) segments (in the order of the
+// plan) and during the forward pass only keeps the values read by a later segment, then evaluates each segment again
+// right before deriving it. About one more forward pass to have O(sqrt(N)) values alive instead of N, for graphs
+// like long unrolled sequences. The segments can also be chosen by hand with checkpoint(), with or without it
+struct Checkpointing {
+	static inline int activeScopes = 0;
+
+	Checkpointing() { ++activeScopes; }
+	~Checkpointing() { --activeScopes; }
+
+	Checkpointing(const Checkpointing&) = delete;
+	Checkpointing& operator = (const Checkpointing&) = delete;
+
+	static bool isActive() {
+		return activeScopes > 0;
+	}
+};
+
+
+
+// while a GradientReady is alive, the backward pass calls it with each leaf that needs a gradient as soon as it's
+// gradient is final (once the last of it's children in the reverse sweep is derived, no one else reads it's value or
+// adds to it's partial after that) instead of leaving them all for after it, so it can be used while it's still in
+// cache, and even changed (see Optimizer::fusedIteration). Each of them is called exactly once, the ones no gradient
+// reached are called at the end, with a partial of zeros. Only for calculateDerivatives, not the parallel version
+struct GradientReady {
+	static inline GradientReady* active = nullptr;
+
+	std::function<void(Node*)> callback;
+	GradientReady* previous;
+
+	GradientReady(const std::function<void(Node*)>& f) : callback(f), previous(active) {
+		active = this;
+	}
+
+	~GradientReady() {
+		active = previous;
+	}
+
+	GradientReady(const GradientReady&) = delete;
+	GradientReady& operator = (const GradientReady&) = delete;
+
+	static bool isActive() {
+		return active != nullptr;
+	}
+};
+
+
+
+// the topological order of a node's ancestry. The parents of a node never change after it's built, so
+// the order is computed the first time it's needed and kept in the node for every eval/calculateDerivatives after that.
+// Raw pointers because the order includes the node itself, the nodes are kept alive by the parents anyway
+struct ExecutionPlan {
+	std::vector<Node*> order;
+
+	// which nodes need a gradient when calculateDerivatives isn't told what to derive with respect to, see requiresGrad.
+	// Only computed the first time something is derived, so the plans used by eval() stay just the order
+	std::vector<bool> requiresGrad;
+
+	// lastUses[i] are the positions of the nodes whose value isn't read by the forward pass after order[i] is
+	// evaluated, see BufferPool. Also only computed the first time it's needed
+	std::vector<std::vector<size_t>> lastUses;
+	std::vector<size_t> lastChild; // position of the last node reading each one
+	bool hasLastUses = false;
+
+	// the leaves of the last calculateDerivatives(wrt) and which nodes need a gradient for them, so deriving with
+	// respect to the same leaves again (every iteration of a training loop) doesn't compute it again
+	std::vector<Node*> wrt;
+	std::vector<bool> wrtRequiresGrad;
+
+	// whether the backward pass reads the value of each node, for the requiresGrad in readByBackwardFor
+	std::vector<bool> readByBackward;
+	std::vector<bool> readByBackwardFor;
+
+	// leavesReady[i] are the positions of the leaves whose gradient is final once order[i] is done in the reverse sweep,
+	// and which of them were given to the GradientReady in this backward pass
+	std::vector<std::vector<size_t>> leavesReady;
+	std::vector<bool> gradientsGiven;
+	bool hasLeavesReady = false;
+};
+
+
 
 struct Node : std::enable_shared_from_this<Node> {
-	std::vector<std::shared_ptr<Node>> parents;
+	std::vector<std::shared_ptr<Node>, ArenaAllocator<std::shared_ptr<Node>>> parents; // in the NodeArena too
 	bool isTrainable;
 	bool isSlowOperation = false;
 
+	// constants are leaves that are never changed after being built (the seeds of gradient functions, the literals
+	// in "x + 1.0f", ...). Operations whose parents are all constants are folded into a new constant when built
+	bool isConstant = false;
+
+	// incremental evaluation. Every node keeps the "time" it's value is from: leaves get a new one whenever they're
+	// changed (markDirty), operations take the newest among their parents when they're evaluated. So an operation
+	// only has to be evaluated again if one of it's parents is newer than it, and as leaves are shared between
+	// graphs (and a single dirty flag would be cleared by whichever graph is evaluated first) this works for all of them.
+	// IMPORTANT: change the value of a leaf with set, or call markDirty after changing it, or graphs already evaluated
+	// won't see the change (see CHECK_LEAF_WRITES)
+	size_t version = 0;
+	static inline size_t clock = 0;
+
+	#if CHECK_LEAF_WRITES
+		// the version the value had the last time this leaf was evaluated, and it's hash then
+		size_t checkedVersion = 0;
+		size_t checkedHash = 0;
+	#endif
+
+	std::shared_ptr<ExecutionPlan> plan;
+
+	// set by calculateDerivatives before the backward pass: a node needs a gradient if it's one of the leaves we're
+	// deriving with respect to, or if one of it's parents needs one. Nodes that don't are skipped by the backward pass,
+	// and operations don't calculate the partials of operands that don't (like the data in a matrix multiplication)
+	bool requiresGrad = true;
+
+	// whether the partial holds something from the current backward pass. Partials aren't zeroed before the backward
+	// pass, they're only cleared (see clearPartial) and the first contribution a node gets is written over whatever
+	// was there, so the partials of nodes no gradient reaches are never allocated or touched
+	bool hasPartial = false;
+
+	// a segment of the graph ends here for the checkpointed backward pass, see Checkpointing
+	bool isCheckpoint = false;
+
+	// the value is in the file of the Offload instead of in memory
+	bool isSpilled = false;
+	size_t spillId = 0;
+
 	#if USE_NAME
 		std::string name;
 		Node(const std::string& n = "") : name(n) {}
@@ -48,9 +317,27 @@ struct Node : std::enable_shared_from_this<Node> {
 	virtual inline NodeTypes getType() = 0;
 	virtual inline void updateGradientFunction() = 0; // similar to derive but to the function, not partial
 	virtual inline void resetGradientFunction(NUM_TYPE defaultValue = 0.0f) = 0; // similar to resetPartial, ...
+	virtual inline bool isGradientFunctionZero() = 0; // nothing to propagate to the parents
+	virtual inline void releasePartial() = 0; // gives the buffers back to the BufferPool
+	virtual inline void releaseValue() = 0;
+	virtual inline void acquireValue() = 0; // gets the value back if it was released
+	virtual inline std::vector<std::vector<NUM_TYPE>*> valueBuffers() = 0; // what an Offload spills
+	virtual inline size_t hashValue() = 0; // for CHECK_LEAF_WRITES
+
+	// whether derive() reads the value of n (this node or one of it's parents), the requiresGrad of the parents is
+	// already set when it's asked. The values the backward pass won't read are given back to the BufferPool as soon
+	// as the forward pass is done with them, operations that don't say otherwise keep all of them
+	virtual inline bool deriveReads(const Node*) const {
+		return true;
+	}
+
+	void clearPartial() {
+		hasPartial = false;
+	}
 
 
-	std::vector<std::shared_ptr<Node>> topologicalSort() {
+	// with stopAtConstants, the ancestors of constants are left out (constants never change, so they don't need them)
+	std::vector<std::shared_ptr<Node>> topologicalSort(bool stopAtConstants = false) {
 		std::vector<std::shared_ptr<Node>> ordering;
 		std::unordered_set<std::shared_ptr<Node>> visited;
 
@@ -61,7 +348,7 @@ struct Node : std::enable_shared_from_this<Node> {
 			}
 
 			visited.insert(node);
-			for (size_t i = 0; i < node->parents.size(); ++i) {
+			for (size_t i = 0; i < node->parents.size() && !(stopAtConstants && node->isConstant); ++i) {
 				addChildren(node->parents[i]);
 			}
 
@@ -75,23 +362,546 @@ struct Node : std::enable_shared_from_this<Node> {
 		return ordering;
 	}
 
+	const ExecutionPlan& getPlan() {
+		if (!plan) {
+			std::vector<std::shared_ptr<Node>> ordering = topologicalSort(true);
+
+			// parts of the graph that don't depend on any leaf that can change (only on constants) are evaluated once
+			// here and frozen into constants, so they are never evaluated or derived again, and the plan stops at them
+			bool frozeSomething = false;
+			for (size_t i = 0; i < ordering.size(); ++i) {
+				if (!ordering[i]->isConstant && ordering[i]->hasOnlyConstantParents()) {
+					ordering[i]->acquireValue();
+					ordering[i]->evaluate();
+					ordering[i]->isConstant = true;
+					ordering[i]->requiresGrad = false;
+					ordering[i]->markDirty();
+
+					frozeSomething = true;
+				}
+			}
+
+			if (frozeSomething) {
+				ordering = topologicalSort(true);
+			}
+
+			plan = std::make_shared<ExecutionPlan>();
+			plan->order.reserve(ordering.size());
+
+			for (size_t i = 0; i < ordering.size(); ++i) {
+				plan->order.push_back(ordering[i].get());
+			}
+
+		}
+
+		return *plan;
+	}
+
+	const std::vector<bool>& getDefaultRequiresGrad() {
+		ExecutionPlan& p = const_cast<ExecutionPlan&>(getPlan());
+
+		if (p.requiresGrad.size() != p.order.size()) {
+
+			// by default derive with respect to the trainable leaves. Graphs that don't use the trainable flag at all
+			// get every leaf that isn't a constant, like before
+			bool hasTrainable = false;
+			for (size_t i = 0; i < p.order.size(); ++i) {
+				hasTrainable = hasTrainable || p.order[i]->isTrainable;
+			}
+
+			std::unordered_set<Node*> wrt;
+			for (size_t i = 0; i < p.order.size(); ++i) {
+				if (!p.order[i]->parents.size() && !p.order[i]->isConstant && (p.order[i]->isTrainable || !hasTrainable)) {
+					wrt.insert(p.order[i]);
+				}
+			}
+
+			p.requiresGrad = propagateRequiresGrad(p.order, wrt);
+		}
+
+		return p.requiresGrad;
+	}
+
+	static std::vector<bool> propagateRequiresGrad(const std::vector<Node*>& ordering, const std::unordered_set<Node*>& wrt) {
+		std::vector<bool> needsGrad(ordering.size(), false);
+		std::unordered_set<Node*> requiring;
+
+		for (size_t i = 0; i < ordering.size(); ++i) {
+			needsGrad[i] = wrt.count(ordering[i]);
+
+			for (size_t j = 0; j < ordering[i]->parents.size() && !needsGrad[i]; ++j) {
+				needsGrad[i] = requiring.count(ordering[i]->parents[j].get());
+			}
+
+			if (needsGrad[i]) requiring.insert(ordering[i]);
+		}
+
+		return needsGrad;
+	}
+
+	const std::vector<std::vector<size_t>>& getLastUses() {
+		ExecutionPlan& p = const_cast<ExecutionPlan&>(getPlan());
+
+		if (!p.hasLastUses) {
+			std::unordered_map<Node*, size_t> position;
+			for (size_t i = 0; i < p.order.size(); ++i) {
+				position[p.order[i]] = i;
+			}
+
+			// the order is topological, so the last child to be seen is the last one to be evaluated
+			p.lastChild.assign(p.order.size(), 0);
+			for (size_t i = 0; i < p.order.size(); ++i) {
+				for (size_t j = 0; j < p.order[i]->parents.size() && !p.order[i]->isConstant; ++j) {
+					p.lastChild[position[p.order[i]->parents[j].get()]] = i;
+				}
+			}
+
+			// leaves and constants can't be recalculated, and the value of the last node is what we're after
+			p.lastUses.resize(p.order.size());
+			for (size_t i = 0; i + 1 < p.order.size(); ++i) {
+				if (p.order[i]->isRecomputable()) {
+					p.lastUses[p.lastChild[i]].push_back(i);
+				}
+			}
+
+			p.hasLastUses = true;
+		}
+
+		return p.lastUses;
+	}
+
+	const std::vector<std::vector<size_t>>& getLeavesReady() {
+		ExecutionPlan& p = const_cast<ExecutionPlan&>(getPlan());
+
+		if (!p.hasLeavesReady) {
+			std::unordered_map<Node*, size_t> position;
+			for (size_t i = 0; i < p.order.size(); ++i) {
+				position[p.order[i]] = i;
+			}
+
+			// the first child in the order is the last one the reverse sweep does
+			std::vector<size_t> firstChild(p.order.size(), p.order.size());
+			for (size_t i = 0; i < p.order.size(); ++i) {
+				for (size_t j = 0; j < p.order[i]->parents.size() && !p.order[i]->isConstant; ++j) {
+					size_t parent = position[p.order[i]->parents[j].get()];
+					firstChild[parent] = std::min(firstChild[parent], i);
+				}
+			}
+
+			p.leavesReady.resize(p.order.size());
+			for (size_t i = 0; i < p.order.size(); ++i) {
+				if (!p.order[i]->isRecomputable() && !p.order[i]->isConstant && firstChild[i] < p.order.size()) {
+					p.leavesReady[firstChild[i]].push_back(i);
+				}
+			}
+
+			p.hasLeavesReady = true;
+		}
+
+		return p.leavesReady;
+	}
+
+	// gives the GradientReady the leaves whose gradient is final once the node at the position is done
+	void giveReadyGradients(size_t position, const std::vector<bool>& needsGrad) {
+		ExecutionPlan& p = const_cast<ExecutionPlan&>(getPlan());
+
+		for (size_t leaf : p.leavesReady[position]) {
+			if (needsGrad[leaf] && p.order[leaf]->hasPartial) {
+				p.gradientsGiven[leaf] = true;
+				GradientReady::active->callback(p.order[leaf]);
+			}
+		}
+	}
+
+	void markDirty() {
+		version = ++clock;
+	}
+
+	// evaluates the node if one of it's parents changed since the last time, the parents must be up to date already
+	void refresh() {
+		if (!parents.size() || isConstant) {
+			if (!version) markDirty();
+
+			#if CHECK_LEAF_WRITES
+				checkLeafWrite();
+			#endif
+
+			return;
+		}
+
+		size_t newest = 0;
+		for (size_t i = 0; i < parents.size(); ++i) {
+			newest = std::max(newest, parents[i]->version);
+		}
+
+		if (version < newest) {
+			acquireValue();
+			evaluate();
+			version = newest;
+		}
+	}
+
+	#if CHECK_LEAF_WRITES
+		void checkLeafWrite() {
+			size_t hash = hashValue();
+
+			if (checkedVersion == version && checkedHash != hash) {
+				throw std::runtime_error("The value of a leaf was changed without markDirty, use set or call markDirty after changing it");
+			}
+
+			checkedVersion = version;
+			checkedHash = hash;
+		}
+	#endif
+
+	bool isRecomputable() const {
+		return parents.size() && !isConstant;
+	}
+
+	// neededAt is the position in the plan of the first node that will read it in the reverse sweep
+	void spillValue(size_t neededAt) {
+		std::vector<std::vector<NUM_TYPE>*> buffers = valueBuffers();
+
+		size_t bytes = 0;
+		for (size_t i = 0; i < buffers.size(); ++i) {
+			bytes += buffers[i]->size() * sizeof(NUM_TYPE);
+		}
+
+		if (bytes < Offload::active->minBytes) return;
+
+		spillId = Offload::active->file.spill(buffers, neededAt);
+		isSpilled = true;
+	}
+
+	void makeResident() {
+		if (!isSpilled) return;
+
+		Offload::active->file.restore(spillId, valueBuffers());
+		isSpilled = false;
+	}
+
+	void makeParentsResident() {
+		for (size_t i = 0; i < parents.size(); ++i) {
+			parents[i]->makeResident();
+		}
+	}
+
+	// gives the value back to the BufferPool, it'll be evaluated again the next time it's refreshed
+	void dropValue() {
+		releaseValue();
+		version = 0;
+	}
+
+	// only the forward pass is incremental, the partials depend on the whole graph.
+	// Partials are only calculated for the nodes that need them (see requiresGrad).
+	// The leaves that need a gradient always end up with a partial, zeros if nothing reached them. Those are the
+	// trainable leaves, or every leaf that isn't a constant when none is trainable (see getDefaultRequiresGrad), so a
+	// non-trainable leaf stops getting a partial once anything in the graph is trainable. Use calculateDerivatives(wrt)
+	// for those. The other leaves lose the partial they had, hasPartial is false and the partials of vectors and
+	// matrices are empty
 	void calculateDerivatives() {
-		std::vector<std::shared_ptr<Node>> ordering = topologicalSort();
+		backward(getPlan().order, getDefaultRequiresGrad());
+	}
+
+	// same, but only derives with respect to the given leaves, whether they are trainable or not
+	void calculateDerivatives(const std::vector<std::shared_ptr<Node>>& wrt) {
+		ExecutionPlan& p = const_cast<ExecutionPlan&>(getPlan());
+
+		bool isSame = p.wrt.size() == wrt.size() && p.wrtRequiresGrad.size() == p.order.size();
+		for (size_t i = 0; i < wrt.size() && isSame; ++i) {
+			isSame = p.wrt[i] == wrt[i].get();
+		}
+
+		if (!isSame) {
+			std::unordered_set<Node*> leaves;
+			p.wrt.clear();
+
+			for (size_t i = 0; i < wrt.size(); ++i) {
+				leaves.insert(wrt[i].get());
+				p.wrt.push_back(wrt[i].get());
+			}
+
+			p.wrtRequiresGrad = propagateRequiresGrad(p.order, leaves);
+		}
+
+		backward(p.order, p.wrtRequiresGrad);
+	}
+
+	void backward(const std::vector<Node*>& ordering, const std::vector<bool>& needsGrad) {
+
+		if (InferenceMode::isActive()) {
+			throw std::runtime_error("Cannot calculate derivatives in inference mode");
+		}
 
 		for (size_t i = 0; i < ordering.size(); ++i) {
-			ordering[i]->evaluate();
-			ordering[i]->resetPartial();
+			ordering[i]->requiresGrad = needsGrad[i];
+		}
+
+		if (GradientReady::isActive()) {
+			getLeavesReady();
+			const_cast<ExecutionPlan&>(getPlan()).gradientsGiven.assign(ordering.size(), false);
+		}
+
+		std::vector<size_t> segmentEnds = getSegmentEnds(ordering);
+
+		if (segmentEnds.size()) {
+			backwardCheckpointed(ordering, needsGrad, segmentEnds);
+		} else {
+			backwardWhole(ordering, needsGrad);
+		}
+
+		// what was spilled and not read back wasn't needed after all
+		if (Offload::isActive()) {
+			for (size_t i = 0; i < ordering.size(); ++i) {
+				if (ordering[i]->isSpilled) {
+					ordering[i]->isSpilled = false;
+					ordering[i]->dropValue();
+				}
+			}
+
+			Offload::active->file.reset();
 		}
 
+		// the GradientReady may have given the partials it got back already
+		const std::vector<bool>* given = GradientReady::isActive() ? &getPlan().gradientsGiven : nullptr;
+
+		for (size_t i = 0; i < ordering.size(); ++i) {
+			if (ordering[i]->parents.size() || (given && (*given)[i])) continue;
+
+			// a leaf the pass didn't derive doesn't keep the partial of an older one, where it could pass for a gradient
+			if (!needsGrad[i]) {
+				ordering[i]->releasePartial();
+				continue;
+			}
+
+			if (!ordering[i]->hasPartial) {
+				ordering[i]->resetPartial();
+			}
+
+			if (given) GradientReady::active->callback(ordering[i]);
+		}
+	}
+
+	void backwardWhole(const std::vector<Node*>& ordering, const std::vector<bool>& needsGrad) {
+
+		// with a BufferPool, the values the backward pass won't read are given back as soon as the last node that
+		// reads them in the forward pass is evaluated, with an Offload the ones it will read may be spilled then
+		bool releasing = BufferPool::isActive() || Offload::isActive();
+		const std::vector<bool>* readByBackward = nullptr;
+		const std::vector<std::vector<size_t>>* lastUses = nullptr;
+
+		if (releasing) {
+			readByBackward = &getReadByBackward(needsGrad);
+			lastUses = &getLastUses();
+		}
+
+		for (size_t i = 0; i < ordering.size(); ++i) {
+			ordering[i]->refresh();
+
+			if (needsGrad[i]) {
+				ordering[i]->clearPartial();
+			}
+
+			for (size_t j = 0; lastUses && j < (*lastUses)[i].size(); ++j) {
+				size_t used = (*lastUses)[i][j];
+
+				if (!(*readByBackward)[used]) {
+					ordering[used]->dropValue();
+				} else {
+					spillIfFar(ordering, used);
+				}
+			}
+		}
+
+		// nothing we care about affects this node
+		if (!this->requiresGrad) return;
+
 		// dx/dx is 1 for whatever x
 		resetPartial(1.0f);
-		for (size_t i = ordering.size(); i > 0; --i) {
-			ordering[i - 1]->derive();
+		deriveRange(ordering, needsGrad, 0, ordering.size(), releasing);
+	}
+
+	// spills the value at the given position of the plan if the reverse sweep won't need it any time soon
+	void spillIfFar(const std::vector<Node*>& ordering, size_t position) {
+		if (!Offload::isActive()) return;
+
+		size_t neededAt = getPlan().lastChild[position];
+
+		if (neededAt + Offload::active->window < ordering.size()) {
+			ordering[position]->spillValue(neededAt);
 		}
 	}
 
+	// where the segments of the checkpointed backward pass end, none if it isn't checkpointed
+	std::vector<size_t> getSegmentEnds(const std::vector<Node*>& ordering) {
+		std::vector<size_t> ends;
+
+		for (size_t i = 0; i + 1 < ordering.size(); ++i) {
+			if (ordering[i]->isCheckpoint) ends.push_back(i);
+		}
+
+		if (ends.empty() && Checkpointing::isActive()) {
+			size_t length = std::ceil(std::sqrt(ordering.size()));
+			for (size_t i = length - 1; i + 1 < ordering.size(); i += length) {
+				ends.push_back(i);
+			}
+		}
+
+		if (ends.size()) ends.push_back(ordering.size() - 1);
+		return ends;
+	}
+
+	void backwardCheckpointed(const std::vector<Node*>& ordering, const std::vector<bool>& needsGrad, const std::vector<size_t>& segmentEnds) {
+		const std::vector<std::vector<size_t>>& lastUses = getLastUses();
+		const std::vector<size_t>& lastChild = getPlan().lastChild;
+
+		std::vector<size_t> segmentEnd(ordering.size());
+		for (size_t i = 0, k = 0; i < ordering.size(); ++i) {
+			if (i > segmentEnds[k]) ++k;
+			segmentEnd[i] = segmentEnds[k];
+		}
+
+		// only the values read by a later segment are kept
+		for (size_t i = 0; i < ordering.size(); ++i) {
+			ordering[i]->refresh();
+
+			if (needsGrad[i]) {
+				ordering[i]->clearPartial();
+			}
+
+			for (size_t j = 0; j < lastUses[i].size(); ++j) {
+				size_t used = lastUses[i][j];
+
+				if (lastChild[used] <= segmentEnd[used]) {
+					ordering[used]->dropValue();
+				} else {
+					spillIfFar(ordering, used);
+				}
+			}
+		}
+
+		if (!this->requiresGrad) return;
+
+		resetPartial(1.0f);
+
+		for (size_t k = segmentEnds.size(); k > 0; --k) {
+			size_t start = k > 1 ? segmentEnds[k - 2] + 1 : 0;
+			size_t end = segmentEnds[k - 1] + 1;
+
+			if (Offload::isActive()) {
+				Offload::active->file.prefetchFrom(start > Offload::active->window ? start - Offload::active->window : 0);
+			}
+
+			// a segment only reads it's own values and the ones kept from the previous segments
+			for (size_t i = start; i < end; ++i) {
+				if (Offload::isActive()) ordering[i]->makeParentsResident();
+				ordering[i]->refresh();
+			}
+
+			deriveRange(ordering, needsGrad, start, end, true);
+
+			// the later segments are done already, so nothing reads these anymore
+			for (size_t i = start; i < end; ++i) {
+				if (ordering[i] != this && ordering[i]->isRecomputable()) ordering[i]->dropValue();
+			}
+		}
+	}
+
+	// derives the nodes in [start, end) of the ordering, from the last one. With release, the partials and values of the
+	// operations are given back once they're derived: nothing else reads them (the parents don't read the values of
+	// their children), the leaves' partials are the ones we're after
+	void deriveRange(const std::vector<Node*>& ordering, const std::vector<bool>& needsGrad, size_t start, size_t end, bool release) {
+		for (size_t i = end; i > start; --i) {
+			Node* node = ordering[i - 1];
+
+			if (Offload::isActive()) {
+				Offload::active->file.prefetchFrom(i > Offload::active->window ? i - Offload::active->window : 0);
+			}
+
+			// a node no gradient reached has nothing to propagate
+			if (needsGrad[i - 1] && node->hasPartial && node->hasParentRequiringGrad()) {
+				if (Offload::isActive()) {
+					node->makeResident();
+					node->makeParentsResident();
+				}
+
+				node->derive();
+
+				if (release && node != this && node->parents.size()) {
+					node->releasePartial();
+					node->dropValue();
+				}
+			}
+
+			if (GradientReady::isActive()) {
+				giveReadyGradients(i - 1, needsGrad);
+			}
+		}
+	}
+
+
+	// by position in the plan, computed again only when what needs a gradient changes
+	const std::vector<bool>& getReadByBackward(const std::vector<bool>& needsGrad) {
+		ExecutionPlan& p = const_cast<ExecutionPlan&>(getPlan());
+
+		if (p.readByBackwardFor != needsGrad) {
+			std::unordered_set<const Node*> read = valuesReadByBackward(p.order, needsGrad);
+
+			p.readByBackward.assign(p.order.size(), false);
+			for (size_t i = 0; i < p.order.size(); ++i) {
+				p.readByBackward[i] = read.count(p.order[i]);
+			}
+
+			p.readByBackwardFor = needsGrad;
+		}
+
+		return p.readByBackward;
+	}
+
+	// only the nodes that will be derived are asked what they read
+	static std::unordered_set<const Node*> valuesReadByBackward(const std::vector<Node*>& ordering, const std::vector<bool>& needsGrad) {
+		std::unordered_set<const Node*> read;
+
+		for (size_t i = 0; i < ordering.size(); ++i) {
+			const Node* node = ordering[i];
+			if (!needsGrad[i] || !node->hasParentRequiringGrad()) continue;
+
+			if (node->deriveReads(node)) read.insert(node);
+
+			for (size_t j = 0; j < node->parents.size(); ++j) {
+				if (node->deriveReads(node->parents[j].get())) read.insert(node->parents[j].get());
+			}
+		}
+
+		return read;
+	}
+
+	// a node only has to be derived if it has somewhere to propagate the partial to
+	bool hasParentRequiringGrad() const {
+		for (size_t i = 0; i < parents.size(); ++i) {
+			if (parents[i]->requiresGrad) return true;
+		}
+
+		return false;
+	}
+
+	bool hasOnlyConstantParents() const {
+		for (size_t i = 0; i < parents.size(); ++i) {
+			if (!parents[i]->isConstant) return false;
+		}
+
+		return parents.size() > 0;
+	}
+
 
 	void calculateGradientFunctions() {
+
+		if (InferenceMode::isActive()) {
+			throw std::runtime_error("Cannot calculate gradient functions in inference mode");
+		}
+
+		NodeCache::Scope scope;
+
 		std::vector<std::shared_ptr<Node>> ordering = topologicalSort();
 
 		for (size_t i = 0; i < ordering.size(); ++i) {
@@ -100,7 +910,18 @@ struct Node : std::enable_shared_from_this<Node> {
 
 		// dx/dx is 1 for whatever x
 		resetGradientFunction(1.0f);
+		propagateGradientFunctions(ordering);
+	}
+
+	// reverse sweep over an already sorted graph, the gradient function of the last node has to be seeded already.
+	// Nodes in the mask (if there is one) that are false are skipped, as are nodes with a zero gradient function,
+	// because the contribution to their parents would be zero anyway
+	static void propagateGradientFunctions(const std::vector<std::shared_ptr<Node>>& ordering, const std::vector<bool>& mask = {}) {
 		for (size_t i = ordering.size(); i > 0; --i) {
+			if ((mask.size() && !mask[i - 1]) || ordering[i - 1]->isGradientFunctionZero()) {
+				continue;
+			}
+
 			ordering[i - 1]->updateGradientFunction();
 		}
 	}
@@ -115,7 +936,8 @@ struct Node : std::enable_shared_from_this<Node> {
 
 	// I also tried to separate them in slow layers and fast layers, because parallelizing the fast operations
 	// is not worth it. Probably there's a better way to do this, but that's for the future.
-	std::tuple<NodeMat, NodeMat> layeredTopologicalSort(bool excludeFirstGeneration = false) {
+	// with stopAtConstants, the ancestors of constants are left out, like in topologicalSort
+	std::tuple<NodeMat, NodeMat> layeredTopologicalSort(bool excludeFirstGeneration = false, bool stopAtConstants = false) {
 		NodeMat layersSlow;
 		NodeMat layersFast;
 		std::unordered_set<std::shared_ptr<Node>> visited;
@@ -130,7 +952,7 @@ struct Node : std::enable_shared_from_this<Node> {
 			visited.insert(node);
 
 			int maxParentLayer = -1;
-			for (size_t i = 0; i < node->parents.size(); ++i) {
+			for (size_t i = 0; i < node->parents.size() && !(stopAtConstants && node->isConstant); ++i) {
 				addChildren(node->parents[i]);
 				maxParentLayer = std::max(maxParentLayer, layerNum[node->parents[i]]);
 			}
@@ -161,22 +983,41 @@ struct Node : std::enable_shared_from_this<Node> {
 	// speed up over the non parallel version (execution time went from ~67 seconds to ~45 secunds)
 	void calculateDerivativesParallel() {
 
-		auto [layersFast, layersSlow] = layeredTopologicalSort();
+		if (InferenceMode::isActive()) {
+			throw std::runtime_error("Cannot calculate derivatives in inference mode");
+		}
+
+		// freezes the constant parts of the graph and marks what needs a gradient
+		const std::vector<Node*>& ordering = getPlan().order;
+		const std::vector<bool>& needsGrad = getDefaultRequiresGrad();
+
+		for (size_t i = 0; i < ordering.size(); ++i) {
+			ordering[i]->requiresGrad = needsGrad[i];
+
+			// like backward, the leaves that aren't derived don't keep an old partial
+			if (!needsGrad[i] && !ordering[i]->parents.size()) ordering[i]->releasePartial();
+		}
+
+		// the same nodes as the plan, the frozen parts of the graph aren't evaluated or derived again
+		auto [layersFast, layersSlow] = layeredTopologicalSort(false, true);
+
+		// unlike backward, the partials are zeroed up front: nodes in the same layer can add to the same parent
+		// at the same time, and the first write of accumulatePartial isn't safe for that
 
 		for (size_t i = 0; i < layersSlow.size(); ++i) {
 
 			// for slow layers, try to parallelize what we can
 			#pragma omp parallel for schedule(dynamic) if(layersSlow[i].size() > 1)
 			for (size_t j = 0; j < layersSlow[i].size(); ++j) {
-				layersSlow[i][j]->evaluate();
-				layersSlow[i][j]->resetPartial();
+				layersSlow[i][j]->refresh();
+				if (layersSlow[i][j]->requiresGrad) layersSlow[i][j]->resetPartial();
 			}
 
 
 			// for fast layers, the overhead of parallelizing would actually cause a performance decrease
 			for (size_t j = 0; j < layersFast[i].size(); ++j) {
-				layersFast[i][j]->evaluate();
-				layersFast[i][j]->resetPartial();
+				layersFast[i][j]->refresh();
+				if (layersFast[i][j]->requiresGrad) layersFast[i][j]->resetPartial();
 			}
 		}
 
@@ -187,12 +1028,12 @@ struct Node : std::enable_shared_from_this<Node> {
 
 			#pragma omp parallel for schedule(dynamic) if(layersSlow[i - 1].size() > 1)
 			for (size_t j = 0; j < layersSlow[i - 1].size(); ++j) {
-				layersSlow[i - 1][j]->derive();
+				if (layersSlow[i - 1][j]->requiresGrad) layersSlow[i - 1][j]->derive();
 			}
 
 
 			for (size_t j = 0; j < layersFast[i - 1].size(); ++j) {
-				layersFast[i - 1][j]->derive();
+				if (layersFast[i - 1][j]->requiresGrad) layersFast[i - 1][j]->derive();
 			}
 		}
 	}
@@ -209,13 +1050,41 @@ struct Node : std::enable_shared_from_this<Node> {
 
 
 	void eval() {
-		std::vector<std::shared_ptr<Node>> ordering = topologicalSort();
+		const std::vector<Node*>& ordering = getPlan().order;
+
+		// nothing will be derived, so the values are only needed until their last child is evaluated
+		if (InferenceMode::isActive() && BufferPool::isActive()) {
+			const std::vector<std::vector<size_t>>& lastUses = getLastUses();
+
+			for (size_t i = 0; i < ordering.size(); ++i) {
+				ordering[i]->refresh();
+
+				for (size_t j = 0; j < lastUses[i].size(); ++j) {
+					ordering[lastUses[i][j]]->dropValue();
+				}
+			}
+
+			return;
+		}
 
 		for (size_t i = 0; i < ordering.size(); ++i) {
-			ordering[i]->evaluate();
+			ordering[i]->refresh();
 		}
 	}
 };
 
 
+
+template <typename T>
+T NodeCache::insert(const Key& k, const T& node) {
+	std::shared_ptr<Node> n = node;
+
+	if (n->parents.size()) {
+		store(k, n);
+	}
+
+	return node;
+}
+
+
 #endif
@@ -11,13 +11,12 @@ using namespace std;
 
 
 
-// should probably make a way to avoid calculating partials that are not in the wrt list
-// also, doing get->(i) everytime is not needed, as it creates a whole new operation
+// doing get->(i) everytime is not needed, as it creates a whole new operation
 vector<vector<float>> getJacobian(const Vec& F, const Vec& wrt) {
 	vector<vector<float>> jacobian(F->size);
 
 	for (size_t i = 0; i < F->size; ++i) {
-		F->get(i)->calculateDerivatives();
+		F->get(i)->calculateDerivatives({ wrt });
 
 		jacobian[i] = wrt->partial;
 	}
@@ -141,7 +140,7 @@ int main() {
 		vector<vector<float>> jac = getJacobian(f, params);
 
 		// Gauss-Newton iteration for Nonlinear Least Squares problems
-		params->value += solveLinearSystem(ATA(jac), ATb(jac, f->value * -1.0f));
+		params->set(params->value + solveLinearSystem(ATA(jac), ATb(jac, f->value * -1.0f)));
 	}
 
 	cout << "Final params: " << params->value << "\n"; // show final solution
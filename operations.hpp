@@ -22,7 +22,14 @@ struct Add : Scalar {
 
 	static Var build(const Var& v1, const Var& v2) {
 
-		std::shared_ptr<Add> node = std::make_shared<Add>();
+		// 0 + x = x
+		if (v1->isConstantEqualTo(0.0f)) return v2;
+		if (v2->isConstantEqualTo(0.0f)) return v1;
+
+		NodeCache::Key key = NodeCache::key<Add>(v1, v2);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Add> node = makeNode<Add>();
 
 		node->a = v1;
 		node->b = v2;
@@ -33,16 +40,20 @@ struct Add : Scalar {
 		node->parents.push_back(v1);
 		node->parents.push_back(v2);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = a->value + b->value;
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		a->partial += partial;
-		b->partial += partial;
+		if (a->requiresGrad) a->accumulatePartial(partial);
+		if (b->requiresGrad) b->accumulatePartial(partial);
 	}
 
 	void updateGradientFunction() override final {
@@ -59,7 +70,13 @@ struct Subtract : Scalar {
 
 	static Var build(const Var& v1, const Var& v2) {
 
-		std::shared_ptr<Subtract> node = std::make_shared<Subtract>();
+		// x - 0 = x
+		if (v2->isConstantEqualTo(0.0f)) return v1;
+
+		NodeCache::Key key = NodeCache::key<Subtract>(v1, v2);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Subtract> node = makeNode<Subtract>();
 
 		node->a = v1;
 		node->b = v2;
@@ -70,16 +87,20 @@ struct Subtract : Scalar {
 		node->parents.push_back(v1);
 		node->parents.push_back(v2);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = a->value - b->value;
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		a->partial += partial;
-		b->partial -= partial;
+		if (a->requiresGrad) a->accumulatePartial(partial);
+		if (b->requiresGrad) b->accumulatePartial(-partial);
 	}
 
 	void updateGradientFunction() override final {
@@ -96,7 +117,15 @@ struct Mult : Scalar {
 
 	static Var build(const Var& v1, const Var& v2) {
 
-		std::shared_ptr<Mult> node = std::make_shared<Mult>();
+		// 0 * x = 0 (in gradient functions, see NodeCache::isActive), 1 * x = x
+		if (NodeCache::isActive() && (v1->isConstantEqualTo(0.0f) || v2->isConstantEqualTo(0.0f))) return Scalar::constant(0.0f);
+		if (v1->isConstantEqualTo(1.0f)) return v2;
+		if (v2->isConstantEqualTo(1.0f)) return v1;
+
+		NodeCache::Key key = NodeCache::key<Mult>(v1, v2);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Mult> node = makeNode<Mult>();
 
 		node->a = v1;
 		node->b = v2;
@@ -107,16 +136,20 @@ struct Mult : Scalar {
 		node->parents.push_back(v1);
 		node->parents.push_back(v2);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = a->value * b->value;
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || (n == b.ptr.get() && a->requiresGrad);
+	}
+
 	void derive() override final {
-		a->partial += partial * b->value;
-		b->partial += partial * a->value;
+		if (a->requiresGrad) a->accumulatePartial(partial * b->value);
+		if (b->requiresGrad) b->accumulatePartial(partial * a->value);
 	}
 
 	void updateGradientFunction() override final {
@@ -134,7 +167,14 @@ struct Div : Scalar {
 
 	static Var build(const Var& v1, const Var& v2) {
 
-		std::shared_ptr<Div> node = std::make_shared<Div>();
+		// 0 / x = 0 (in gradient functions, see NodeCache::isActive), x / 1 = x
+		if (NodeCache::isActive() && v1->isConstantEqualTo(0.0f)) return Scalar::constant(0.0f);
+		if (v2->isConstantEqualTo(1.0f)) return v1;
+
+		NodeCache::Key key = NodeCache::key<Div>(v1, v2);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Div> node = makeNode<Div>();
 
 		node->a = v1;
 		node->b = v2;
@@ -145,22 +185,26 @@ struct Div : Scalar {
 		node->parents.push_back(v1);
 		node->parents.push_back(v2);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = a->value / b->value;
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || n == b.ptr.get();
+	}
+
 	void derive() override final {
 		NUM_TYPE inv = 1.0f / (b->value * b->value);
-		a->partial += partial * b->value * inv;
-		b->partial -= partial * a->value * inv;
+		if (a->requiresGrad) a->accumulatePartial(partial * b->value * inv);
+		if (b->requiresGrad) b->accumulatePartial(-partial * a->value * inv);
 	}
 
 	void updateGradientFunction() override final {
 
-		Var inv = Div::build(Scalar::build(1.0f), Mult::build(b, b));
+		Var inv = Div::build(Scalar::constant(1.0f), Mult::build(b, b));
 
 		a->gradientFunction = Add::build(a->gradientFunction, Mult::build(Mult::build(gradientFunction, b), inv));
 		b->gradientFunction = Subtract::build(b->gradientFunction, Mult::build(Mult::build(gradientFunction, a), inv));
@@ -179,7 +223,10 @@ struct Sin : Scalar {
 
 	static Var build(const Var& v) {
 
-		std::shared_ptr<Sin> node = std::make_shared<Sin>();
+		NodeCache::Key key = NodeCache::key<Sin>(v);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Sin> node = makeNode<Sin>();
 
 		node->a = v;
 		#if USE_NAME
@@ -188,15 +235,19 @@ struct Sin : Scalar {
 
 		node->parents.push_back(v);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = std::sin(a->value);
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == a.ptr.get();
+	}
+
 	void derive() override final {
-		a->partial += partial * std::cos(a->value);
+		a->accumulatePartial(partial * std::cos(a->value));
 	}
 
 	void updateGradientFunction() override final;
@@ -210,7 +261,10 @@ struct Cos : Scalar {
 
 	static Var build(const Var& v) {
 
-		std::shared_ptr<Cos> node = std::make_shared<Cos>();
+		NodeCache::Key key = NodeCache::key<Cos>(v);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Cos> node = makeNode<Cos>();
 
 		node->a = v;
 		#if USE_NAME
@@ -219,15 +273,19 @@ struct Cos : Scalar {
 
 		node->parents.push_back(v);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = std::cos(a->value);
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == a.ptr.get();
+	}
+
 	void derive() override final {
-		a->partial -= partial * std::sin(a->value);
+		a->accumulatePartial(-partial * std::sin(a->value));
 	}
 
 	void updateGradientFunction() override final;
@@ -256,7 +314,10 @@ struct Exp : Scalar {
 
 	static Var build(const Var& v) {
 
-		std::shared_ptr<Exp> node = std::make_shared<Exp>();
+		NodeCache::Key key = NodeCache::key<Exp>(v);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Exp> node = makeNode<Exp>();
 
 		node->a = v;
 		#if USE_NAME
@@ -265,15 +326,19 @@ struct Exp : Scalar {
 
 		node->parents.push_back(v);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = std::exp(a->value);
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == this;
+	}
+
 	void derive() override final {
-		a->partial += partial * value;
+		a->accumulatePartial(partial * value);
 	}
 
 	void updateGradientFunction() override final {
@@ -289,7 +354,10 @@ struct Ln : Scalar {
 
 	static Var build(const Var& v) {
 
-		std::shared_ptr<Ln> node = std::make_shared<Ln>();
+		NodeCache::Key key = NodeCache::key<Ln>(v);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Ln> node = makeNode<Ln>();
 
 		node->a = v;
 		#if USE_NAME
@@ -298,15 +366,19 @@ struct Ln : Scalar {
 
 		node->parents.push_back(v);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = std::log(a->value);
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == a.ptr.get();
+	}
+
 	void derive() override final {
-		a->partial += partial / a->value;
+		a->accumulatePartial(partial / a->value);
 	}
 
 	void updateGradientFunction() override final {
@@ -324,7 +396,10 @@ struct Sqrt : Scalar {
 
 	static Var build(const Var& v) {
 
-		std::shared_ptr<Sqrt> node = std::make_shared<Sqrt>();
+		NodeCache::Key key = NodeCache::key<Sqrt>(v);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Sqrt> node = makeNode<Sqrt>();
 
 		node->a = v;
 		#if USE_NAME
@@ -333,19 +408,23 @@ struct Sqrt : Scalar {
 
 		node->parents.push_back(v);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = std::sqrt(a->value);
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == this;
+	}
+
 	void derive() override final {
-		a->partial += partial / (2.0f * value);
+		a->accumulatePartial(partial / (2.0f * value));
 	}
 
 	void updateGradientFunction() override final {
-		a->gradientFunction = Add::build(a->gradientFunction, Div::build(gradientFunction, Mult::build(std::static_pointer_cast<Scalar>(shared_from_this()), Scalar::build(2.0f))));
+		a->gradientFunction = Add::build(a->gradientFunction, Div::build(gradientFunction, Mult::build(std::static_pointer_cast<Scalar>(shared_from_this()), Scalar::constant(2.0f))));
 	}
 };
 
@@ -368,29 +447,29 @@ inline Var operator / (const Var& v1, const Var& v2) {
 
 
 inline Var operator + (const Var& v, NUM_TYPE f) {
-	return Add::build(v, Scalar::build(f));
+	return Add::build(v, Scalar::constant(f));
 }
 
 inline Var operator - (const Var& v, NUM_TYPE f) {
-	return Subtract::build(v, Scalar::build(f));
+	return Subtract::build(v, Scalar::constant(f));
 }
 inline Var operator - (NUM_TYPE f, const Var& v) {
-	return Subtract::build(Scalar::build(f), v);
+	return Subtract::build(Scalar::constant(f), v);
 }
 inline Var operator - (const Var& v) {
-	return Subtract::build(Scalar::build(0.0f), v);
+	return Subtract::build(Scalar::constant(0.0f), v);
 }
 
 inline Var operator * (const Var& v, NUM_TYPE f) {
-	return Mult::build(v, Scalar::build(f));
+	return Mult::build(v, Scalar::constant(f));
 }
 
 inline Var operator / (NUM_TYPE f, const Var& v) {
-	return Div::build(Scalar::build(f), v);
+	return Div::build(Scalar::constant(f), v);
 }
 
 inline Var operator / (const Var& v, NUM_TYPE f) {
-	return Div::build(v, Scalar::build(f));
+	return Div::build(v, Scalar::constant(f));
 }
 
 Var sqrt(const Var& v) {
@@ -428,7 +507,7 @@ struct VecDotVec : Scalar {
 
 	static Var build(const Vec& v1, const Vec& v2) {
 
-		std::shared_ptr<VecDotVec> node = std::make_shared<VecDotVec>();
+		std::shared_ptr<VecDotVec> node = makeNode<VecDotVec>();
 
 		node->a = v1;
 		node->b = v2;
@@ -450,9 +529,13 @@ struct VecDotVec : Scalar {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || (n == b.ptr.get() && a->requiresGrad);
+	}
+
 	void derive() override final {
-		a->partial += b->value * partial;
-		b->partial += a->value * partial;
+		if (a->requiresGrad) a->accumulatePartial([&](size_t i) { return b->value[i] * partial; });
+		if (b->requiresGrad) b->accumulatePartial([&](size_t i) { return a->value[i] * partial; });
 	}
 
 	void updateGradientFunction() override final;
@@ -476,15 +559,13 @@ struct VecHadamardVec : Vector {
 
 	Vec a, b;
 
-	VecHadamardVec(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecHadamardVec(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Vec& v2) {
 
-		std::shared_ptr<VecHadamardVec> node = std::make_shared<VecHadamardVec>(v1->size);
+		std::shared_ptr<VecHadamardVec> node = makeNode<VecHadamardVec>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -504,12 +585,14 @@ struct VecHadamardVec : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || (n == b.ptr.get() && a->requiresGrad);
+	}
+
 	void derive() override final {
 
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += b->value[i] * partial[i];
-			b->partial[i] += a->value[i] * partial[i];
-		}
+		if (a->requiresGrad) a->accumulatePartial([&](size_t i) { return b->value[i] * partial[i]; });
+		if (b->requiresGrad) b->accumulatePartial([&](size_t i) { return a->value[i] * partial[i]; });
 	}
 };
 
@@ -523,15 +606,13 @@ struct VecDivVec : Vector {
 
 	Vec a, b;
 
-	VecDivVec(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecDivVec(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Vec& v2) {
 
-		std::shared_ptr<VecDivVec> node = std::make_shared<VecDivVec>(v1->size);
+		std::shared_ptr<VecDivVec> node = makeNode<VecDivVec>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -551,13 +632,17 @@ struct VecDivVec : Vector {
 		}
 	}
 
-	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || n == b.ptr.get();
+	}
 
-			NUM_TYPE inv = 1.0f / (b->value[i] * b->value[i]);
+	void derive() override final {
+		if (a->requiresGrad) {
+			a->accumulatePartial([&](size_t i) { return b->value[i] / (b->value[i] * b->value[i]) * partial[i]; });
+		}
 
-			a->partial[i] += b->value[i] * inv * partial[i];
-			b->partial[i] -= a->value[i] * inv * partial[i];
+		if (b->requiresGrad) {
+			b->accumulatePartial([&](size_t i) { return -a->value[i] / (b->value[i] * b->value[i]) * partial[i]; });
 		}
 	}
 };
@@ -572,15 +657,13 @@ struct VecDivVar : Vector {
 	Vec a;
 	Var b;
 
-	VecDivVar(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecDivVar(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Var& v2) {
 
-		std::shared_ptr<VecDivVar> node = std::make_shared<VecDivVar>(v1->size);
+		std::shared_ptr<VecDivVar> node = makeNode<VecDivVar>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -601,12 +684,22 @@ struct VecDivVar : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || n == b.ptr.get();
+	}
+
 	void derive() override final {
 		NUM_TYPE inv = 1.0f / (b->value * b->value);
 
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += b->value * inv * partial[i];
-			b->partial -= a->value[i] * inv * partial[i];
+		if (a->requiresGrad) a->accumulatePartial([&](size_t i) { return b->value * inv * partial[i]; });
+
+		if (b->requiresGrad) {
+			NUM_TYPE sum = 0.0f;
+			for (size_t i = 0; i < size; ++i) {
+				sum -= a->value[i] * inv * partial[i];
+			}
+
+			b->accumulatePartial(sum);
 		}
 	}
 };
@@ -621,15 +714,20 @@ struct VecMultVar : Vector {
 	Vec a;
 	Var b;
 
-	VecMultVar(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecMultVar(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Var& v2) {
 
-		std::shared_ptr<VecMultVar> node = std::make_shared<VecMultVar>(v1->size);
+		// v * 0 = 0 (in gradient functions, see NodeCache::isActive), v * 1 = v
+		if (NodeCache::isActive() && (v1->isConstantEqualTo(0.0f) || v2->isConstantEqualTo(0.0f))) return Vector::constant(v1->size, 0.0f);
+		if (v2->isConstantEqualTo(1.0f)) return v1;
+
+		NodeCache::Key key = NodeCache::key<VecMultVar>(v1, v2);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<VecMultVar> node = makeNode<VecMultVar>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -640,7 +738,7 @@ struct VecMultVar : Vector {
 		node->parents.push_back(v1);
 		node->parents.push_back(v2);
 
-		return node;
+		return NodeCache::insert(key, Vector::fold(node));
 	}
 
 	void evaluate() override final {
@@ -649,11 +747,20 @@ struct VecMultVar : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || (n == b.ptr.get() && a->requiresGrad);
+	}
+
 	void derive() override final {
+		if (a->requiresGrad) a->accumulatePartial([&](size_t i) { return b->value * partial[i]; });
 
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += b->value * partial[i];
-			b->partial += partial[i] * a->value[i];
+		if (b->requiresGrad) {
+			NUM_TYPE sum = 0.0f;
+			for (size_t i = 0; i < size; ++i) {
+				sum += partial[i] * a->value[i];
+			}
+
+			b->accumulatePartial(sum);
 		}
 	}
 };
@@ -672,15 +779,13 @@ struct VecAddVar : Vector {
 	Vec a;
 	Var b;
 
-	VecAddVar(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecAddVar(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Var& v2) {
 
-		std::shared_ptr<VecAddVar> node = std::make_shared<VecAddVar>(v1->size);
+		std::shared_ptr<VecAddVar> node = makeNode<VecAddVar>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -700,10 +805,20 @@ struct VecAddVar : Vector {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += partial[i];
-			b->partial += partial[i];
+		if (a->requiresGrad) a->accumulatePartial(partial);
+
+		if (b->requiresGrad) {
+			NUM_TYPE sum = 0.0f;
+			for (size_t i = 0; i < size; ++i) {
+				sum += partial[i];
+			}
+
+			b->accumulatePartial(sum);
 		}
 	}
 };
@@ -722,15 +837,13 @@ struct VecMinusVec : Vector {
 
 	Vec a, b;
 
-	VecMinusVec(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecMinusVec(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Vec& v2) {
 
-		std::shared_ptr<VecMinusVec> node = std::make_shared<VecMinusVec>(v1->size);
+		std::shared_ptr<VecMinusVec> node = makeNode<VecMinusVec>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -750,9 +863,13 @@ struct VecMinusVec : Vector {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		a->partial += partial;
-		b->partial += partial * -1.0f;
+		if (a->requiresGrad) a->accumulatePartial(partial);
+		if (b->requiresGrad) b->accumulatePartial([&](size_t i) { return -partial[i]; });
 	}
 };
 
@@ -767,15 +884,20 @@ struct VecPlusVec : Vector {
 
 	Vec a, b;
 
-	VecPlusVec(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecPlusVec(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Vec& v2) {
 
-		std::shared_ptr<VecPlusVec> node = std::make_shared<VecPlusVec>(v1->size);
+		// 0 + v = v
+		if (v1->isConstantEqualTo(0.0f)) return v2;
+		if (v2->isConstantEqualTo(0.0f)) return v1;
+
+		NodeCache::Key key = NodeCache::key<VecPlusVec>(v1, v2);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<VecPlusVec> node = makeNode<VecPlusVec>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -786,7 +908,7 @@ struct VecPlusVec : Vector {
 		node->parents.push_back(v1);
 		node->parents.push_back(v2);
 
-		return node;
+		return NodeCache::insert(key, Vector::fold(node));
 	}
 
 	void evaluate() override final {
@@ -795,9 +917,13 @@ struct VecPlusVec : Vector {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		a->partial += partial;
-		b->partial += partial;
+		if (a->requiresGrad) a->accumulatePartial(partial);
+		if (b->requiresGrad) b->accumulatePartial(partial);
 	}
 
 	void updateGradientFunction() override final {
@@ -816,15 +942,13 @@ struct VecMinusVar : Vector {
 	Vec a;
 	Var b;
 
-	VecMinusVar(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecMinusVar(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Var& v2) {
 
-		std::shared_ptr<VecMinusVar> node = std::make_shared<VecMinusVar>(v1->size);
+		std::shared_ptr<VecMinusVar> node = makeNode<VecMinusVar>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -844,10 +968,20 @@ struct VecMinusVar : Vector {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += partial[i];
-			b->partial -= partial[i];
+		if (a->requiresGrad) a->accumulatePartial(partial);
+
+		if (b->requiresGrad) {
+			NUM_TYPE sum = 0.0f;
+			for (size_t i = 0; i < size; ++i) {
+				sum -= partial[i];
+			}
+
+			b->accumulatePartial(sum);
 		}
 	}
 };
@@ -869,15 +1003,13 @@ struct VecTanh : Vector {
 
 	Vec a;
 
-	VecTanh(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecTanh(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v) {
 
-		std::shared_ptr<VecTanh> node = std::make_shared<VecTanh>(v->size);
+		std::shared_ptr<VecTanh> node = makeNode<VecTanh>(v->size);
 
 		node->a = v;
 		#if USE_NAME
@@ -895,10 +1027,12 @@ struct VecTanh : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == this;
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += (1.0f - value[i] * value[i]) * partial[i];
-		}
+		a->accumulatePartial([&](size_t i) { return (1.0f - value[i] * value[i]) * partial[i]; });
 	}
 };
 
@@ -913,15 +1047,13 @@ struct VecSigmoid : Vector {
 
 	Vec a;
 
-	VecSigmoid(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecSigmoid(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v) {
 
-		std::shared_ptr<VecSigmoid> node = std::make_shared<VecSigmoid>(v->size);
+		std::shared_ptr<VecSigmoid> node = makeNode<VecSigmoid>(v->size);
 
 		node->a = v;
 		#if USE_NAME
@@ -939,10 +1071,12 @@ struct VecSigmoid : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == this;
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += value[i] * (1.0f - value[i]) * partial[i];
-		}
+		a->accumulatePartial([&](size_t i) { return value[i] * (1.0f - value[i]) * partial[i]; });
 	}
 };
 
@@ -958,15 +1092,13 @@ struct VecExp : Vector {
 
 	Vec a;
 
-	VecExp(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecExp(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v) {
 
-		std::shared_ptr<VecExp> node = std::make_shared<VecExp>(v->size);
+		std::shared_ptr<VecExp> node = makeNode<VecExp>(v->size);
 
 		node->a = v;
 		#if USE_NAME
@@ -984,10 +1116,12 @@ struct VecExp : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == this;
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += value[i] * partial[i];
-		}
+		a->accumulatePartial([&](size_t i) { return value[i] * partial[i]; });
 	}
 };
 
@@ -1000,15 +1134,13 @@ struct VecLog : Vector {
 
 	Vec a;
 
-	VecLog(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecLog(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v) {
 
-		std::shared_ptr<VecLog> node = std::make_shared<VecLog>(v->size);
+		std::shared_ptr<VecLog> node = makeNode<VecLog>(v->size);
 
 		node->a = v;
 		#if USE_NAME
@@ -1026,10 +1158,12 @@ struct VecLog : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == a.ptr.get();
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += partial[i] / a->value[i];
-		}
+		a->accumulatePartial([&](size_t i) { return partial[i] / a->value[i]; });
 	}
 };
 
@@ -1043,15 +1177,13 @@ struct VecMaxElements : Vector {
 	Vec a;
 	NUM_TYPE m;
 
-	VecMaxElements(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecMaxElements(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v, NUM_TYPE m = 0.0f) {
 
-		std::shared_ptr<VecMaxElements> node = std::make_shared<VecMaxElements>(v->size);
+		std::shared_ptr<VecMaxElements> node = makeNode<VecMaxElements>(v->size);
 
 		node->a = v;
 		node->m = m;
@@ -1070,10 +1202,12 @@ struct VecMaxElements : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == this;
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += partial[i] * (value[i] >= m);
-		}
+		a->accumulatePartial([&](size_t i) { return partial[i] * (value[i] >= m); });
 	}
 };
 
@@ -1086,21 +1220,46 @@ Vec max(const Vec& v, NUM_TYPE m = 0.0f) {
 
 
 
+// masks are vectors with a value for each column of a matrix (each sequence of a batch, for a state of
+// [hidden, batch]) or each element of a vector, the positions where it's 0 are masked out. Operations that take one
+// don't compute the masked out positions and give no gradient through them. The masked sigmoid, tanh and multiply hold
+// 0 there (not sigmoid(0), ...), so only masked operations, masked sums and the candidate of a masked update (which
+// takes prev there) should read them
+inline void getActivePositions(const Vec& mask, size_t size, std::vector<size_t>& active) {
+	active.clear();
+
+	for (size_t j = 0; j < size; ++j) {
+		if (!mask.ptr || mask->value[j] != 0.0f) active.push_back(j);
+	}
+}
+
+// sets the masked out columns of a matrix value to 0, the buffers are reused so they'd hold anything otherwise
+inline void clearMaskedColumns(std::vector<std::vector<NUM_TYPE>>& value, const Vec& mask, size_t activeCount) {
+	if (!mask.ptr || activeCount == mask->size) return;
+
+	for (size_t i = 0; i < value.size(); ++i) {
+		for (size_t j = 0; j < mask->size; ++j) {
+			if (mask->value[j] == 0.0f) value[i][j] = 0.0f;
+		}
+	}
+}
+
+
+
 struct MatSigmoid : Matrix {
 
 	Mat a;
+	Vec mask; // over the columns, optional
+	std::vector<size_t> active;
 
-	MatSigmoid(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f) {
+	MatSigmoid(size_t r = 0, size_t c = 0) {
 		rows = r;
 		cols = c;
-
-		value = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue));
-		partial = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f));
 	}
 
-	static Mat build(const Mat& m) {
+	static Mat build(const Mat& m, const Vec& mask = Vec()) {
 
-		std::shared_ptr<MatSigmoid> node = std::make_shared<MatSigmoid>(m->rows, m->cols);
+		std::shared_ptr<MatSigmoid> node = makeNode<MatSigmoid>(m->rows, m->cols);
 
 		node->a = m;
 		#if USE_NAME
@@ -1109,28 +1268,231 @@ struct MatSigmoid : Matrix {
 
 		node->parents.push_back(m);
 
+		if (mask.ptr) {
+			node->mask = mask;
+			node->parents.push_back(mask);
+		}
+
 		return node;
 	}
 
 	void evaluate() override final {
+		getActivePositions(mask, cols, active);
+		clearMaskedColumns(value, mask, active.size());
+
 		for (size_t i = 0; i < a->rows; ++i) {
-			for (size_t j = 0; j < a->cols; ++j) {
+			for (size_t j : active) {
 				value[i][j] = 1.0f / (1.0f + std::exp(-a->value[i][j]));
 			}
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == this || n == mask.ptr.get();
+	}
+
 	void derive() override final {
+		getActivePositions(mask, cols, active);
+		if (active.empty()) return;
+
+		a->accumulatePartial([&](size_t i, size_t j) {
+			if (mask.ptr && mask->value[j] == 0.0f) return NUM_TYPE(0.0f);
+			return value[i][j] * (1.0f - value[i][j]) * partial[i][j];
+		});
+	}
+};
+
+Mat sigmoid(const Mat& m, const Vec& mask = Vec()) {
+	return MatSigmoid::build(m, mask);
+}
+
+
+
+struct MatTanh : Matrix {
+
+	Mat a;
+	Vec mask; // over the columns, optional
+	std::vector<size_t> active;
+
+	MatTanh(size_t r = 0, size_t c = 0) {
+		rows = r;
+		cols = c;
+	}
+
+	static Mat build(const Mat& m, const Vec& mask = Vec()) {
+
+		std::shared_ptr<MatTanh> node = makeNode<MatTanh>(m->rows, m->cols);
+
+		node->a = m;
+		#if USE_NAME
+			node->name = "tanh(" + m->name + ")";
+		#endif
+
+		node->parents.push_back(m);
+
+		if (mask.ptr) {
+			node->mask = mask;
+			node->parents.push_back(mask);
+		}
+
+		return node;
+	}
+
+	void evaluate() override final {
+		getActivePositions(mask, cols, active);
+		clearMaskedColumns(value, mask, active.size());
+
 		for (size_t i = 0; i < a->rows; ++i) {
-			for (size_t j = 0; j < a->cols; ++j) {
-				a->partial[i][j] += value[i][j] * (1.0f - value[i][j]) * partial[i][j];
+			for (size_t j : active) {
+				value[i][j] = 2.0f / (1.0f + std::exp(-2.0f * a->value[i][j])) - 1.0f;
+			}
+		}
+	}
+
+	bool deriveReads(const Node* n) const override final {
+		return n == this || n == mask.ptr.get();
+	}
+
+	void derive() override final {
+		getActivePositions(mask, cols, active);
+		if (active.empty()) return;
+
+		a->accumulatePartial([&](size_t i, size_t j) {
+			if (mask.ptr && mask->value[j] == 0.0f) return NUM_TYPE(0.0f);
+			return (1.0f - value[i][j] * value[i][j]) * partial[i][j];
+		});
+	}
+};
+
+Mat tanh(const Mat& m, const Vec& mask = Vec()) {
+	return MatTanh::build(m, mask);
+}
+
+
+
+// the state of a batch of sequences of different lengths after a step: column j is the one of candidate where the mask
+// isn't 0, and the one of prev where it is. The sequences that ended keep their state, and the steps after their end
+// give no gradient
+struct MatMaskedUpdate : Matrix {
+
+	Mat prev, candidate;
+	Vec mask;
+	std::vector<size_t> active;
+
+	MatMaskedUpdate(size_t r = 0, size_t c = 0) {
+		rows = r;
+		cols = c;
+	}
+
+	static Mat build(const Mat& prev, const Mat& candidate, const Vec& mask) {
+
+		if (prev->rows != candidate->rows || prev->cols != candidate->cols || mask->size != prev->cols) {
+			throw std::runtime_error("The state, the new state and the mask of a masked update don't match");
+		}
+
+		std::shared_ptr<MatMaskedUpdate> node = makeNode<MatMaskedUpdate>(prev->rows, prev->cols);
+
+		node->prev = prev;
+		node->candidate = candidate;
+		node->mask = mask;
+		#if USE_NAME
+			node->name = "maskedUpdate(" + prev->name + ", " + candidate->name + ", " + mask->name + ")";
+		#endif
+
+		node->parents.push_back(prev);
+		node->parents.push_back(candidate);
+		node->parents.push_back(mask);
+
+		return node;
+	}
+
+	void evaluate() override final {
+		getActivePositions(mask, cols, active);
+
+		for (size_t i = 0; i < rows; ++i) {
+			value[i] = prev->value[i];
+
+			for (size_t j : active) {
+				value[i][j] = candidate->value[i][j];
 			}
 		}
 	}
+
+	bool deriveReads(const Node* n) const override final {
+		return n == mask.ptr.get();
+	}
+
+	void derive() override final {
+		getActivePositions(mask, cols, active);
+
+		if (prev->requiresGrad) {
+			prev->accumulatePartial([&](size_t i, size_t j) { return mask->value[j] != 0.0f ? 0.0f : partial[i][j]; });
+		}
+
+		// when every sequence ended, nothing reaches the step that made the candidate
+		if (candidate->requiresGrad && active.size()) {
+			candidate->accumulatePartial([&](size_t i, size_t j) { return mask->value[j] != 0.0f ? partial[i][j] : 0.0f; });
+		}
+	}
 };
 
-Mat sigmoid(const Mat& m) {
-	return MatSigmoid::build(m);
+inline Mat maskedUpdate(const Mat& prev, const Mat& candidate, const Vec& mask) {
+	return MatMaskedUpdate::build(prev, candidate, mask);
+}
+
+
+
+// same for a single sequence, with a mask for the step (see GraphCapture::replaySequence)
+struct VecMaskedUpdate : Vector {
+
+	Vec prev, candidate;
+	Var mask;
+
+	VecMaskedUpdate(size_t s = 0) {
+		size = s;
+	}
+
+	static Vec build(const Vec& prev, const Vec& candidate, const Var& mask) {
+
+		if (prev->size != candidate->size) {
+			throw std::runtime_error("The state and the new state of a masked update don't match");
+		}
+
+		std::shared_ptr<VecMaskedUpdate> node = makeNode<VecMaskedUpdate>(prev->size);
+
+		node->prev = prev;
+		node->candidate = candidate;
+		node->mask = mask;
+		#if USE_NAME
+			node->name = "maskedUpdate(" + prev->name + ", " + candidate->name + ", " + mask->name + ")";
+		#endif
+
+		node->parents.push_back(prev);
+		node->parents.push_back(candidate);
+		node->parents.push_back(mask);
+
+		return node;
+	}
+
+	void evaluate() override final {
+		value = (mask->value != 0.0f) ? candidate->value : prev->value;
+	}
+
+	bool deriveReads(const Node* n) const override final {
+		return n == mask.ptr.get();
+	}
+
+	void derive() override final {
+		if (mask->value != 0.0f) {
+			if (candidate->requiresGrad) candidate->accumulatePartial(partial);
+		} else {
+			if (prev->requiresGrad) prev->accumulatePartial(partial);
+		}
+	}
+};
+
+inline Vec maskedUpdate(const Vec& prev, const Vec& candidate, const Var& mask) {
+	return VecMaskedUpdate::build(prev, candidate, mask);
 }
 
 
@@ -1162,7 +1524,7 @@ struct VecMax : Scalar {
 
 	static Var build(const Vec& v) {
 
-		std::shared_ptr<VecMax> node = std::make_shared<VecMax>();
+		std::shared_ptr<VecMax> node = makeNode<VecMax>();
 
 		node->a = v;
 		#if USE_NAME
@@ -1188,8 +1550,12 @@ struct VecMax : Scalar {
 
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		a->partial[maxIndex] += partial;
+		a->touchPartial()[maxIndex] += partial;
 	}
 };
 
@@ -1225,15 +1591,13 @@ struct MatDotVec : Vector {
 	Mat a;
 	Vec b;
 
-	MatDotVec(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	MatDotVec(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Mat& m, const Vec& v) {
 
-		std::shared_ptr<MatDotVec> node = std::make_shared<MatDotVec>(m->rows);
+		std::shared_ptr<MatDotVec> node = makeNode<MatDotVec>(m->rows);
 
 		node->a = m;
 		node->b = v;
@@ -1258,17 +1622,27 @@ struct MatDotVec : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || (n == b.ptr.get() && a->requiresGrad);
+	}
+
 	void derive() override final {
 
-		for (size_t i = 0; i < a->rows; ++i) {
-			for (size_t j = 0; j < a->cols; ++j) {
+		// when the matrix or the vector is just data (doesn't need a gradient) this skips half the work
 
-				// b->partial = A^T * partial
-				b->partial[j] += a->value[i][j] * partial[i];
+		// b->partial = A^T * partial
+		// (going through the rows of A, so this one is zeroed first instead of written)
+		if (b->requiresGrad) {
+			std::vector<NUM_TYPE>& bPartial = b->touchPartial();
 
-				a->partial[i][j] += b->value[j] * partial[i];
+			for (size_t i = 0; i < a->rows; ++i) {
+				for (size_t j = 0; j < a->cols; ++j) {
+					bPartial[j] += a->value[i][j] * partial[i];
+				}
 			}
 		}
+
+		if (a->requiresGrad) a->accumulatePartial([&](size_t i, size_t j) { return b->value[j] * partial[i]; });
 	}
 };
 
@@ -1282,18 +1656,17 @@ inline Vec operator * (const Mat& m, const Vec& v) {
 struct MatDotMat : Matrix {
 
 	Mat a, b;
+	Vec mask; // over the columns of b (and of the result), optional
+	std::vector<size_t> active;
 
-	MatDotMat(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f) {
+	MatDotMat(size_t r = 0, size_t c = 0) {
 		rows = r;
 		cols = c;
-
-		value = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue));
-		partial = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f));
 	}
 
-	static Mat build(const Mat& m1, const Mat& m2) {
+	static Mat build(const Mat& m1, const Mat& m2, const Vec& mask = Vec()) {
 
-		std::shared_ptr<MatDotMat> node = std::make_shared<MatDotMat>(m1->rows, m2->cols);
+		std::shared_ptr<MatDotMat> node = makeNode<MatDotMat>(m1->rows, m2->cols);
 
 		node->a = m1;
 		node->b = m2;
@@ -1304,6 +1677,11 @@ struct MatDotMat : Matrix {
 		node->parents.push_back(m1);
 		node->parents.push_back(m2);
 
+		if (mask.ptr) {
+			node->mask = mask;
+			node->parents.push_back(mask);
+		}
+
 		return node;
 	}
 
@@ -1313,6 +1691,26 @@ struct MatDotMat : Matrix {
 		size_t p = a->cols;
 		size_t m = b->cols;
 
+		// only the columns of the sequences that haven't ended
+		if (mask.ptr) {
+			getActivePositions(mask, m, active);
+			clearMaskedColumns(value, mask, active.size());
+
+			for (size_t i = 0; i < n; ++i) {
+				for (size_t j : active) {
+					value[i][j] = 0.0f;
+				}
+
+				for (size_t k = 0; k < p; ++k) {
+					for (size_t j : active) {
+						value[i][j] += a->value[i][k] * b->value[k][j];
+					}
+				}
+			}
+
+			return;
+		}
+
 		for (size_t i = 0; i < n; ++i) {
 
 			// reset i-th row
@@ -1326,23 +1724,46 @@ struct MatDotMat : Matrix {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || (n == b.ptr.get() && a->requiresGrad) || n == mask.ptr.get();
+	}
+
 	void derive() override final {
 
 		size_t n = a->rows;
 		size_t p = a->cols;
 		size_t m = b->cols;
 
+		if (mask.ptr) {
+			deriveMasked();
+			return;
+		}
+
 		// A: (n, p), B: (p, m), C: (n, m)
 
 		// a->partial = partial * b->value^T
 		// b->partial = a->value^T * partial
 
-		for (size_t i = 0; i < n; ++i) {
-			for (size_t j = 0; j < p; ++j) {
+		// when one of them is just data (doesn't need a gradient) this skips half the work
+		if (a->requiresGrad) {
+			a->accumulatePartial([&](size_t i, size_t j) {
+				NUM_TYPE sum = 0.0f;
 				for (size_t k = 0; k < m; ++k) {
-					a->partial[i][j] += partial[i][k] * b->value[j][k];
+					sum += partial[i][k] * b->value[j][k];
+				}
 
-					b->partial[j][k] += a->value[i][j] * partial[i][k];
+				return sum;
+			});
+		}
+
+		if (b->requiresGrad) {
+			std::vector<std::vector<NUM_TYPE>>& bPartial = b->touchPartial();
+
+			for (size_t i = 0; i < n; ++i) {
+				for (size_t j = 0; j < p; ++j) {
+					for (size_t k = 0; k < m; ++k) {
+						bPartial[j][k] += a->value[i][j] * partial[i][k];
+					}
 				}
 			}
 		}
@@ -1363,12 +1784,46 @@ struct MatDotMat : Matrix {
 			}
 		}*/
 	}
+
+	// same, only through the columns in the mask
+	void deriveMasked() {
+		getActivePositions(mask, b->cols, active);
+		if (active.empty()) return;
+
+		if (a->requiresGrad) {
+			a->accumulatePartial([&](size_t i, size_t j) {
+				NUM_TYPE sum = 0.0f;
+				for (size_t k : active) {
+					sum += partial[i][k] * b->value[j][k];
+				}
+
+				return sum;
+			});
+		}
+
+		if (b->requiresGrad) {
+			std::vector<std::vector<NUM_TYPE>>& bPartial = b->touchPartial();
+
+			for (size_t i = 0; i < a->rows; ++i) {
+				for (size_t j = 0; j < a->cols; ++j) {
+					for (size_t k : active) {
+						bPartial[j][k] += a->value[i][j] * partial[i][k];
+					}
+				}
+			}
+		}
+	}
 };
 
 inline Mat operator * (const Mat& m1, const Mat& m2) {
 	return MatDotMat::build(m1, m2);
 }
 
+// m1 * m2 for the columns of m2 in the mask (see getActivePositions)
+inline Mat multiply(const Mat& m1, const Mat& m2, const Vec& mask) {
+	return MatDotMat::build(m1, m2, mask);
+}
+
 
 
 
@@ -1377,17 +1832,17 @@ struct TransposeMat : Matrix {
 
 	Mat a;
 
-	TransposeMat(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f) {
+	TransposeMat(size_t r = 0, size_t c = 0) {
 		rows = r;
 		cols = c;
-
-		value = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue));
-		partial = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f));
 	}
 
 	static Mat build(const Mat& m) {
 
-		std::shared_ptr<TransposeMat> node = std::make_shared<TransposeMat>(m->cols, m->rows);
+		NodeCache::Key key = NodeCache::key<TransposeMat>(m);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<TransposeMat> node = makeNode<TransposeMat>(m->cols, m->rows);
 
 		node->a = m;
 		#if USE_NAME
@@ -1396,7 +1851,7 @@ struct TransposeMat : Matrix {
 
 		node->parents.push_back(m);
 
-		return node;
+		return NodeCache::insert(key, Matrix::fold(node));
 	}
 
 	void evaluate() override final {
@@ -1407,13 +1862,12 @@ struct TransposeMat : Matrix {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		for (size_t j = 0; j < cols; ++j) {
-			for (size_t i = 0; i < rows; ++i) {
-				a->partial[j][i] += partial[i][j];
-			//	partial[i][j] += a->partial[j][i];
-			}
-		}
+		a->accumulatePartial([&](size_t j, size_t i) { return partial[i][j]; });
 	}
 
 	void updateGradientFunction() override final {
@@ -1434,17 +1888,14 @@ struct MatPlusVec : Matrix {
 	Mat a;
 	Vec b;
 
-	MatPlusVec(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f) {
+	MatPlusVec(size_t r = 0, size_t c = 0) {
 		rows = r;
 		cols = c;
-
-		value = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue));
-		partial = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f));
 	}
 
 	static Mat build(const Mat& m, const Vec& v) {
 
-		std::shared_ptr<MatPlusVec> node = std::make_shared<MatPlusVec>(m->rows, m->cols);
+		std::shared_ptr<MatPlusVec> node = makeNode<MatPlusVec>(m->rows, m->cols);
 
 		node->a = m;
 		node->b = v;
@@ -1466,12 +1917,22 @@ struct MatPlusVec : Matrix {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < rows; ++i) {
-			for (size_t j = 0; j < cols; ++j) {
-				a->partial[i][j] += partial[i][j];
-				b->partial[i] += partial[i][j];
-			}
+		if (a->requiresGrad) a->accumulatePartial(partial);
+
+		if (b->requiresGrad) {
+			b->accumulatePartial([&](size_t i) {
+				NUM_TYPE sum = 0.0f;
+				for (size_t j = 0; j < cols; ++j) {
+					sum += partial[i][j];
+				}
+
+				return sum;
+			});
 		}
 	}
 };
@@ -1494,17 +1955,14 @@ struct MatMinusMat : Matrix {
 
 	Mat a, b;
 
-	MatMinusMat(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f) {
+	MatMinusMat(size_t r = 0, size_t c = 0) {
 		rows = r;
 		cols = c;
-
-		value = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue));
-		partial = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f));
 	}
 
 	static Mat build(const Mat& m1, const Mat& m2) {
 
-		std::shared_ptr<MatMinusMat> node = std::make_shared<MatMinusMat>(m1->rows, m1->cols);
+		std::shared_ptr<MatMinusMat> node = makeNode<MatMinusMat>(m1->rows, m1->cols);
 
 		node->a = m1;
 		node->b = m2;
@@ -1526,13 +1984,13 @@ struct MatMinusMat : Matrix {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < a->rows; ++i) {
-			for (size_t j = 0; j < a->cols; ++j) {
-				a->partial[i][j] += partial[i][j];
-				b->partial[i][j] -= partial[i][j];
-			}
-		}
+		if (a->requiresGrad) a->accumulatePartial(partial);
+		if (b->requiresGrad) b->accumulatePartial([&](size_t i, size_t j) { return -partial[i][j]; });
 	}
 };
 
@@ -1544,17 +2002,21 @@ struct MatPlusMat : Matrix {
 
 	Mat a, b;
 
-	MatPlusMat(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f) {
+	MatPlusMat(size_t r = 0, size_t c = 0) {
 		rows = r;
 		cols = c;
-
-		value = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue));
-		partial = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f));
 	}
 
 	static Mat build(const Mat& m1, const Mat& m2) {
 
-		std::shared_ptr<MatPlusMat> node = std::make_shared<MatPlusMat>(m1->rows, m1->cols);
+		// 0 + m = m
+		if (m1->isConstantEqualTo(0.0f)) return m2;
+		if (m2->isConstantEqualTo(0.0f)) return m1;
+
+		NodeCache::Key key = NodeCache::key<MatPlusMat>(m1, m2);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<MatPlusMat> node = makeNode<MatPlusMat>(m1->rows, m1->cols);
 
 		node->a = m1;
 		node->b = m2;
@@ -1565,7 +2027,7 @@ struct MatPlusMat : Matrix {
 		node->parents.push_back(m1);
 		node->parents.push_back(m2);
 
-		return node;
+		return NodeCache::insert(key, Matrix::fold(node));
 	}
 
 	void evaluate() override final {
@@ -1576,13 +2038,13 @@ struct MatPlusMat : Matrix {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < a->rows; ++i) {
-			for (size_t j = 0; j < a->cols; ++j) {
-				a->partial[i][j] += partial[i][j];
-				b->partial[i][j] += partial[i][j];
-			}
-		}
+		if (a->requiresGrad) a->accumulatePartial(partial);
+		if (b->requiresGrad) b->accumulatePartial(partial);
 	}
 };
 
@@ -1602,17 +2064,14 @@ struct MatHadamardMat : Matrix {
 
 	Mat a, b;
 
-	MatHadamardMat(size_t r = 0, size_t c = 0, NUM_TYPE fillValue = 0.0f) {
+	MatHadamardMat(size_t r = 0, size_t c = 0) {
 		rows = r;
 		cols = c;
-
-		value = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, fillValue));
-		partial = std::vector<std::vector<NUM_TYPE>>(r, std::vector<NUM_TYPE>(c, 0.0f));
 	}
 
 	static Mat build(const Mat& m1, const Mat& m2) {
 
-		std::shared_ptr<MatHadamardMat> node = std::make_shared<MatHadamardMat>(m1->rows, m1->cols);
+		std::shared_ptr<MatHadamardMat> node = makeNode<MatHadamardMat>(m1->rows, m1->cols);
 
 		node->a = m1;
 		node->b = m2;
@@ -1634,13 +2093,13 @@ struct MatHadamardMat : Matrix {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return (n == a.ptr.get() && b->requiresGrad) || (n == b.ptr.get() && a->requiresGrad);
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < a->rows; ++i) {
-			for (size_t j = 0; j < a->cols; ++j) {
-				a->partial[i][j] += b->value[i][j] * partial[i][j];
-				b->partial[i][j] += a->value[i][j] * partial[i][j];
-			}
-		}
+		if (a->requiresGrad) a->accumulatePartial([&](size_t i, size_t j) { return b->value[i][j] * partial[i][j]; });
+		if (b->requiresGrad) b->accumulatePartial([&](size_t i, size_t j) { return a->value[i][j] * partial[i][j]; });
 	}
 };
 
@@ -1661,14 +2120,16 @@ inline Mat hadamard(const Mat& m1, const Mat& m2) {
 struct VecSum : Scalar {
 
 	Vec a;
+	Vec mask; // optional, the elements masked out aren't added
+	std::vector<size_t> active;
 
 	VecSum() {
 
 	}
 
-	static Var build(const Vec& v) {
+	static Var build(const Vec& v, const Vec& mask = Vec()) {
 
-		std::shared_ptr<VecSum> node = std::make_shared<VecSum>();
+		std::shared_ptr<VecSum> node = makeNode<VecSum>();
 
 		node->a = v;
 		#if USE_NAME
@@ -1677,6 +2138,11 @@ struct VecSum : Scalar {
 
 		node->parents.push_back(v);
 
+		if (mask.ptr) {
+			node->mask = mask;
+			node->parents.push_back(mask);
+		}
+
 		return node;
 	}
 
@@ -1684,15 +2150,35 @@ struct VecSum : Scalar {
 
 		value = 0.0f;
 
+		if (mask.ptr) {
+			getActivePositions(mask, a->size, active);
+
+			for (size_t i : active) {
+				value += a->value[i];
+			}
+
+			return;
+		}
+
 		for (size_t i = 0; i < a->size; ++i) {
 			value += a->value[i];
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == mask.ptr.get();
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < a->size; ++i) {
-			a->partial[i] += partial;
+		if (mask.ptr) {
+			getActivePositions(mask, a->size, active);
+			if (active.empty()) return;
+
+			a->accumulatePartial([&](size_t i) { return mask->value[i] != 0.0f ? partial : 0.0f; });
+			return;
 		}
+
+		a->accumulatePartial([&](size_t) { return partial; });
 	}
 };
 
@@ -1700,20 +2186,26 @@ inline Var sum(const Vec& v) {
 	return VecSum::build(v);
 }
 
+inline Var sum(const Vec& v, const Vec& mask) {
+	return VecSum::build(v, mask);
+}
+
 
 
 
 struct MatSum : Scalar {
 
 	Mat a;
+	Vec mask; // over the columns, optional
+	std::vector<size_t> active;
 
 	MatSum() {
 
 	}
 
-	static Var build(const Mat& m) {
+	static Var build(const Mat& m, const Vec& mask = Vec()) {
 
-		std::shared_ptr<MatSum> node = std::make_shared<MatSum>();
+		std::shared_ptr<MatSum> node = makeNode<MatSum>();
 
 		node->a = m;
 		#if USE_NAME
@@ -1722,6 +2214,11 @@ struct MatSum : Scalar {
 
 		node->parents.push_back(m);
 
+		if (mask.ptr) {
+			node->mask = mask;
+			node->parents.push_back(mask);
+		}
+
 		return node;
 	}
 
@@ -1729,6 +2226,18 @@ struct MatSum : Scalar {
 
 		value = 0.0f;
 
+		if (mask.ptr) {
+			getActivePositions(mask, a->cols, active);
+
+			for (size_t i = 0; i < a->rows; ++i) {
+				for (size_t j : active) {
+					value += a->value[i][j];
+				}
+			}
+
+			return;
+		}
+
 		for (size_t i = 0; i < a->rows; ++i) {
 			for (size_t j = 0; j < a->cols; ++j) {
 				value += a->value[i][j];
@@ -1736,12 +2245,20 @@ struct MatSum : Scalar {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == mask.ptr.get();
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < a->rows; ++i) {
-			for (size_t j = 0; j < a->cols; ++j) {
-				a->partial[i][j] += partial;
-			}
+		if (mask.ptr) {
+			getActivePositions(mask, a->cols, active);
+			if (active.empty()) return;
+
+			a->accumulatePartial([&](size_t, size_t j) { return mask->value[j] != 0.0f ? partial : 0.0f; });
+			return;
 		}
+
+		a->accumulatePartial([&](size_t, size_t) { return partial; });
 	}
 };
 
@@ -1749,6 +2266,11 @@ inline Var sum(const Mat& m) {
 	return MatSum::build(m);
 }
 
+// only the columns in the mask
+inline Var sum(const Mat& m, const Vec& mask) {
+	return MatSum::build(m, mask);
+}
+
 
 
 
@@ -1760,15 +2282,13 @@ struct VecMaxVec : Vector {
 
 	Vec a, b;
 
-	VecMaxVec(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecMaxVec(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Vec& v2) {
 
-		std::shared_ptr<VecMaxVec> node = std::make_shared<VecMaxVec>(v1->size);
+		std::shared_ptr<VecMaxVec> node = makeNode<VecMaxVec>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -1788,14 +2308,13 @@ struct VecMaxVec : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == a.ptr.get() || n == b.ptr.get();
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
-			if (a->value[i] >= b->value[i]) {
-				a->partial[i] += partial[i];
-			} else {
-				b->partial[i] += partial[i];
-			}
-		}
+		if (a->requiresGrad) a->accumulatePartial([&](size_t i) { return a->value[i] >= b->value[i] ? partial[i] : 0.0f; });
+		if (b->requiresGrad) b->accumulatePartial([&](size_t i) { return a->value[i] >= b->value[i] ? 0.0f : partial[i]; });
 	}
 };
 
@@ -1808,15 +2327,13 @@ struct VecSin : Vector {
 
 	Vec a;
 
-	VecSin(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VecSin(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v) {
 
-		std::shared_ptr<VecSin> node = std::make_shared<VecSin>(v->size);
+		std::shared_ptr<VecSin> node = makeNode<VecSin>(v->size);
 
 		node->a = v;
 		#if USE_NAME
@@ -1834,10 +2351,12 @@ struct VecSin : Vector {
 		}
 	}
 
+	bool deriveReads(const Node* n) const override final {
+		return n == a.ptr.get();
+	}
+
 	void derive() override final {
-		for (size_t i = 0; i < size; ++i) {
-			a->partial[i] += partial[i] * std::cos(a->value[i]);
-		}
+		a->accumulatePartial([&](size_t i) { return partial[i] * std::cos(a->value[i]); });
 	}
 };
 
@@ -1846,7 +2365,7 @@ inline Vec sin(const Vec& v) {
 }
 
 inline Vec operator - (NUM_TYPE v1, const Vec& v2) {
-	return VecMinusVec::build(Vector::build(v2->size, v1), v2);
+	return VecMinusVec::build(Vector::constant(v2->size, v1), v2);
 }
 
 
@@ -1877,11 +2396,40 @@ void VectorConcat::updateGradientFunction() {
 
 
 
+// every row of the jacobian is built over the same sorted graph and inside the same NodeCache scope, so the rows
+// share all the subexpressions they have in common instead of each one being a separate graph. Row i is seeded
+// with the unit vector e_i, which the builders simplify away, so it only builds gradient functions for the part
+// of the graph that reaches F[i]. Nodes that don't depend on wrt are skipped altogether
 Mat getJacobianFunction(const Vec& F, const Vec& wrt) {
-	vector<Vec> jacobian(F->size);
+	NodeCache::Scope scope;
+
+	std::vector<std::shared_ptr<Node>> ordering = F->topologicalSort();
+
+	std::unordered_set<Node*> dependsOnWrt = { wrt.ptr.get() };
+	std::vector<bool> mask(ordering.size(), false);
+
+	for (size_t i = 0; i < ordering.size(); ++i) {
+		for (size_t j = 0; j < ordering[i]->parents.size() && !mask[i]; ++j) {
+			mask[i] = dependsOnWrt.count(ordering[i]->parents[j].get());
+		}
+
+		if (mask[i]) dependsOnWrt.insert(ordering[i].get());
+	}
+
+	std::vector<Vec> jacobian(F->size);
+	std::vector<NUM_TYPE> seed(F->size, 0.0f);
 
 	for (size_t i = 0; i < F->size; ++i) {
-		F[i]->calculateGradientFunctions();
+		for (size_t j = 0; j < ordering.size(); ++j) {
+			ordering[j]->resetGradientFunction();
+		}
+		wrt->resetGradientFunction();
+
+		seed[i] = 1.0f;
+		F->gradientFunction = Vector::constant(seed);
+		seed[i] = 0.0f;
+
+		Node::propagateGradientFunctions(ordering, mask);
 
 		jacobian[i] = wrt->gradientFunction;
 	}
@@ -1895,6 +2443,159 @@ Vec getGradientFunction(const Var& f, const Vec& wrt) {
 }
 
 
+// a recurrence over the rows of a sequence, row t of the value is cell(sequence[t], row t - 1), starting from initial.
+// The graph of the cell is built once, over two leaves that stand for the input and the state of a step, and then run
+// for every step, instead of building a copy of the cell for each one. The nodes the cell reads that don't depend
+// on the input or the state (the weights, mostly) are parents of the scan, so the gradient reaches them like for any
+// other operation. Only the states are kept: the backward pass goes through the steps in reverse, evaluating the
+// cell again for each one and deriving it with the partial of it's state plus what came back from the next step
+struct Scan : Matrix {
+
+	Mat sequence;
+	Vec initial;
+
+	Vec input, state, output;
+	std::vector<Node*> cell; // the operations that depend on input or state, in order. output keeps them alive
+
+	Scan(size_t r = 0, size_t c = 0) {
+		rows = r;
+		cols = c;
+	}
+
+	static Mat build(const std::function<Vec(const Vec& input, const Vec& state)>& f, const Vec& initialState, const Mat& seq) {
+
+		std::shared_ptr<Scan> node = makeNode<Scan>(seq->rows, initialState->size);
+
+		node->sequence = seq;
+		node->initial = initialState;
+		node->input = Vector::build(seq->cols);
+		node->state = Vector::build(initialState->size);
+		node->output = f(node->input, node->state);
+
+		if (!node->output.ptr || node->output->size != initialState->size) {
+			throw std::runtime_error("The cell of a scan has to return a state of the same size");
+		}
+
+		#if USE_NAME
+			node->name = "scan(" + node->output->name + ", " + initialState->name + ", " + seq->name + ")";
+		#endif
+
+		node->parents.push_back(seq);
+		node->parents.push_back(initialState);
+
+		std::vector<std::shared_ptr<Node>> ordering = node->output->topologicalSort();
+
+		std::unordered_set<Node*> dependent = { node->input.ptr.get(), node->state.ptr.get() };
+		std::unordered_set<Node*> outside = { seq.ptr.get(), initialState.ptr.get() };
+
+		for (size_t i = 0; i < ordering.size(); ++i) {
+			Node* n = ordering[i].get();
+
+			bool isDependent = false;
+			for (size_t j = 0; j < n->parents.size() && !dependent.count(n); ++j) {
+				isDependent = isDependent || dependent.count(n->parents[j].get());
+			}
+
+			if (!isDependent) continue;
+
+			dependent.insert(n);
+			node->cell.push_back(n);
+
+			for (size_t j = 0; j < n->parents.size(); ++j) {
+				std::shared_ptr<Node>& p = n->parents[j];
+
+				if (!dependent.count(p.get()) && !p->isConstant && outside.insert(p.get()).second) {
+					node->parents.push_back(p);
+				}
+			}
+		}
+
+		if (!dependent.count(node->output.ptr.get())) {
+			throw std::runtime_error("The cell of a scan has to depend on it's input or it's state");
+		}
+
+		return Matrix::fold(node);
+	}
+
+	// evaluates the cell for step t, the states before it have to be evaluated already
+	void runStep(size_t t) {
+		input->value = sequence->value[t];
+		state->value = t ? value[t - 1] : initial->value;
+		input->markDirty();
+		state->markDirty();
+
+		for (size_t i = 0; i < cell.size(); ++i) {
+			cell[i]->refresh();
+		}
+	}
+
+	void evaluate() override final {
+		for (size_t t = 0; t < rows; ++t) {
+			runStep(t);
+			value[t] = output->value;
+		}
+	}
+
+	void derive() override final {
+
+		// the parents of the scan already know whether they need a gradient
+		input->requiresGrad = sequence->requiresGrad;
+		state->requiresGrad = true;
+
+		for (size_t i = 0; i < cell.size(); ++i) {
+			cell[i]->requiresGrad = cell[i]->hasParentRequiringGrad();
+		}
+
+		std::vector<NUM_TYPE> carried(cols, 0.0f);
+
+		for (size_t t = rows; t > 0; --t) {
+			runStep(t - 1);
+
+			input->clearPartial();
+			state->clearPartial();
+			for (size_t i = 0; i < cell.size(); ++i) {
+				cell[i]->clearPartial();
+			}
+
+			output->accumulatePartial([&](size_t i) { return partial[t - 1][i] + carried[i]; });
+
+			for (size_t i = cell.size(); i > 0; --i) {
+				Node* n = cell[i - 1];
+				if (n->requiresGrad && n->hasPartial && n->hasParentRequiringGrad()) n->derive();
+			}
+
+			if (state->hasPartial) {
+				std::copy(state->partial.begin(), state->partial.end(), carried.begin());
+			} else {
+				std::fill(carried.begin(), carried.end(), 0.0f);
+			}
+
+			if (sequence->requiresGrad && input->hasPartial) {
+				sequence->touchPartial()[t - 1] += input->partial;
+			}
+		}
+
+		if (initial->requiresGrad) {
+			initial->accumulatePartial(carried);
+		}
+	}
+};
+
+// the states after each step of the recurrence, one per row of the sequence (see Scan)
+inline Mat scan(const std::function<Vec(const Vec& input, const Vec& state)>& cell, const Vec& initialState, const Mat& sequence) {
+	return Scan::build(cell, initialState, sequence);
+}
+
+
+// ends a segment of the checkpointed backward pass at v (see Checkpointing). For an unrolled sequence, checkpointing
+// the state every sqrt(T) steps keeps about sqrt(T) steps in memory
+template <typename T>
+T checkpoint(const T& v) {
+	std::shared_ptr<Node>(v)->isCheckpoint = true;
+	return v;
+}
+
+
 
 
 #endif
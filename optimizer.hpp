@@ -4,8 +4,11 @@
 #include "scalar.hpp"
 #include "vector.hpp"
 #include "matrix.hpp"
+#include "operations.hpp"
 #include <iostream>
 #include <variant>
+#include <cstdint>
+#include <limits>
 
 
 
@@ -31,6 +34,231 @@ MatrixType zerosLike(const MatrixType& a) {
 }
 
 
+// the optimizers update each element on it's own, with a kernel that gets pointers to a run of elements of the
+// parameter, it's partial and each state of the optimizer (all of the same shape as the parameter) and how many there
+// are. It's called once for a scalar or a vector and once for each row of a matrix, so a step reads and writes every
+// element once, in place, and the loops of the kernels are vectorized (omp simd). The ones with a square root only
+// are with -fno-math-errno, otherwise std::sqrt may have to set errno and it's called for each element.
+// Only the elements in the range are updated, for the parallel step (see Optimizer::stepParallel)
+
+// the elements [begin, end) of a parameter, counted row by row for a matrix
+struct ElementRange {
+	size_t begin = 0;
+	size_t end = SIZE_MAX;
+};
+
+template <typename F, typename... States>
+void updateElements(ScalarType& param, const ScalarType& partial, const ElementRange& range, F kernel, States&... states) {
+	if (range.begin == 0 && range.end > 0) {
+		kernel(&param, &partial, size_t(1), &states...);
+	}
+}
+template <typename F, typename... States>
+void updateElements(VectorType& param, const VectorType& partial, const ElementRange& range, F kernel, States&... states) {
+	size_t end = std::min(range.end, param.size());
+	if (range.begin >= end) return;
+
+	kernel(param.data() + range.begin, partial.data() + range.begin, end - range.begin, (states.data() + range.begin)...);
+}
+template <typename F, typename... States>
+void updateElements(MatrixType& param, const MatrixType& partial, const ElementRange& range, F kernel, States&... states) {
+	size_t cols = param.size() ? param[0].size() : 0;
+	if (!cols) return;
+
+	size_t end = std::min(range.end, param.size() * cols);
+
+	for (size_t i = range.begin / cols; i * cols < end; ++i) {
+		size_t from = std::max(range.begin, i * cols) - i * cols;
+		size_t to = std::min(end, (i + 1) * cols) - i * cols;
+
+		kernel(param[i].data() + from, partial[i].data() + from, to - from, (states[i].data() + from)...);
+	}
+}
+
+// added to the square roots the optimizers divide by
+constexpr NUM_TYPE optimizerEpsilon = NUM_TYPE(1e-8);
+
+
+
+// all the parameters seen as one flat vector, each scalar, vector and row of a matrix being a contiguous run of it (a
+// span), in order. The operations on the whole model (the norm of the gradient, clipping it, zeroing it) are a single
+// pass over the spans, and the values and gradients are copied to and from one contiguous buffer with gather and
+// scatter (to save them, to reduce the gradients of several processes, for the optimizers that work on a flat vector).
+// It's only a view, not an arena: the values and partials stay in the std::vectors of each node (and the states of the
+// optimizers in their own), which can't be moved into a shared allocation, so the spans are wherever those buffers are
+struct FlatParameters {
+
+	struct Span {
+		NUM_TYPE* value;
+		NUM_TYPE* partial;
+		size_t size;
+		size_t offset; // in the flat vector
+	};
+
+	std::vector<std::shared_ptr<Scalar>> scalars;
+	std::vector<std::shared_ptr<Vector>> vectors;
+	std::vector<std::shared_ptr<Matrix>> matrices;
+
+	std::vector<Span> spans;
+	size_t size = 0;
+
+	FlatParameters() {}
+
+	FlatParameters(const std::vector<std::shared_ptr<Scalar>>& s, const std::vector<std::shared_ptr<Vector>>& v, const std::vector<std::shared_ptr<Matrix>>& m)
+		: scalars(s), vectors(v), matrices(m) {
+
+		refresh();
+	}
+
+	// the trainable leaves the function depends on, or the given ones
+	FlatParameters(const std::shared_ptr<Node>& f) : FlatParameters(findTrainable(f)) {}
+
+	FlatParameters(const std::vector<std::shared_ptr<Node>>& params) {
+		for (size_t i = 0; i < params.size(); ++i) {
+			switch (params[i]->getType()) {
+				case Node::SCALAR: scalars.push_back(std::dynamic_pointer_cast<Scalar>(params[i])); break;
+				case Node::VECTOR: vectors.push_back(std::dynamic_pointer_cast<Vector>(params[i])); break;
+				case Node::MATRIX: matrices.push_back(std::dynamic_pointer_cast<Matrix>(params[i])); break;
+			}
+		}
+
+		refresh();
+	}
+
+	static std::vector<std::shared_ptr<Node>> findTrainable(const std::shared_ptr<Node>& f) {
+		std::vector<std::shared_ptr<Node>> ordering = f->topologicalSort();
+		std::vector<std::shared_ptr<Node>> trainable;
+
+		for (size_t i = 0; i < ordering.size(); ++i) {
+			if (ordering[i]->isTrainable) trainable.push_back(ordering[i]);
+		}
+
+		return trainable;
+	}
+
+	// the nodes can get new buffers (when their value is assigned, ...), so the spans are found again before every
+	// operation. Doesn't allocate once they've been found once
+	void refresh() {
+		spans.clear();
+		size = 0;
+
+		for (size_t i = 0; i < scalars.size(); ++i) {
+			add(&scalars[i]->value, &scalars[i]->partial, 1);
+		}
+		for (size_t i = 0; i < vectors.size(); ++i) {
+			std::vector<NUM_TYPE>& partial = vectors[i]->touchPartial();
+			add(vectors[i]->value.data(), partial.data(), vectors[i]->value.size());
+		}
+		for (size_t i = 0; i < matrices.size(); ++i) {
+			std::vector<std::vector<NUM_TYPE>>& partial = matrices[i]->touchPartial();
+
+			for (size_t j = 0; j < matrices[i]->value.size(); ++j) {
+				add(matrices[i]->value[j].data(), partial[j].data(), matrices[i]->value[j].size());
+			}
+		}
+	}
+
+	void add(NUM_TYPE* value, NUM_TYPE* partial, size_t n) {
+		spans.push_back({ value, partial, n, size });
+		size += n;
+	}
+
+	// after changing the values
+	void markDirty() {
+		for (size_t i = 0; i < scalars.size(); ++i) scalars[i]->markDirty();
+		for (size_t i = 0; i < vectors.size(); ++i) vectors[i]->markDirty();
+		for (size_t i = 0; i < matrices.size(); ++i) matrices[i]->markDirty();
+	}
+
+	// out must have room for size elements
+	void gatherValues(NUM_TYPE* out) {
+		refresh();
+		for (const Span& span : spans) {
+			std::copy(span.value, span.value + span.size, out + span.offset);
+		}
+	}
+
+	void scatterValues(const NUM_TYPE* in) {
+		refresh();
+		for (const Span& span : spans) {
+			std::copy(in + span.offset, in + span.offset + span.size, span.value);
+		}
+
+		markDirty();
+	}
+
+	void gatherGradients(NUM_TYPE* out) {
+		refresh();
+		for (const Span& span : spans) {
+			std::copy(span.partial, span.partial + span.size, out + span.offset);
+		}
+	}
+
+	void scatterGradients(const NUM_TYPE* in) {
+		refresh();
+		for (const Span& span : spans) {
+			std::copy(in + span.offset, in + span.offset + span.size, span.partial);
+		}
+	}
+
+	// the vector versions resize it
+	void gatherValues(std::vector<NUM_TYPE>& out) {
+		refresh();
+		out.resize(size);
+		gatherValues(out.data());
+	}
+
+	void gatherGradients(std::vector<NUM_TYPE>& out) {
+		refresh();
+		out.resize(size);
+		gatherGradients(out.data());
+	}
+
+	NUM_TYPE gradientNorm() {
+		refresh();
+
+		double sum = 0.0;
+		for (const Span& span : spans) {
+			for (size_t i = 0; i < span.size; ++i) {
+				sum += double(span.partial[i]) * span.partial[i];
+			}
+		}
+
+		return std::sqrt(sum);
+	}
+
+	// scales the gradient down so it's norm is at most maxNorm, returns the norm it had
+	NUM_TYPE clipGradientNorm(NUM_TYPE maxNorm) {
+		NUM_TYPE norm = gradientNorm();
+		if (norm <= maxNorm) return norm;
+
+		NUM_TYPE scale = maxNorm / norm;
+		for (const Span& span : spans) {
+			#pragma omp simd
+			for (size_t i = 0; i < span.size; ++i) {
+				span.partial[i] *= scale;
+			}
+		}
+
+		return norm;
+	}
+
+	void zeroGradients() {
+		refresh();
+		for (const Span& span : spans) {
+			std::fill(span.partial, span.partial + span.size, 0.0f);
+		}
+	}
+};
+
+
+
+// what the optimizers print after an iteration when they're verbose
+inline void printLoss(size_t iter, NUM_TYPE loss) {
+	std::cout << "Loss at iter " << iter << ": " << loss << "\n";
+}
+
+
 template <template<typename> class OptimizerParam>
 struct Optimizer {
 
@@ -44,6 +272,36 @@ struct Optimizer {
 
 	std::shared_ptr<Scalar> func;
 
+	// with COUNT_ALLOCATIONS, optimize throws if any iteration after the first checkAllocationsAfter allocates memory,
+	// the steps of the optimizers and the backward pass of a graph that was already derived don't (with or without a
+	// BufferPool, but the checkpointed one does). -1 to not check
+	int checkAllocationsAfter = -1;
+
+	// all of the parameters as a flat vector, see FlatParameters
+	FlatParameters flat;
+
+	// a part of a parameter updated by the parallel step
+	struct Piece {
+		Node::NodeTypes type;
+		size_t index;
+		ElementRange range;
+	};
+
+	// the pieces of shard i are [shardStarts[i], shardStarts[i + 1])
+	std::vector<Piece> pieces;
+	std::vector<size_t> shardStarts;
+	int shardThreads = 0;
+	size_t shardMinSize = 0;
+
+	// where each parameter is, for the fused steps
+	std::unordered_map<const Node*, Piece> parameterPieces;
+
+	// the gradient is clipped to this norm before each step of optimize, 0 to not clip it
+	NUM_TYPE maxGradientNorm = 0.0f;
+
+	// optimize steps each parameter during the backward pass, see fusedIteration
+	bool fuseSteps = false;
+
 	template<class... Types>
 	Optimizer(const std::shared_ptr<Scalar>& f, Types... args) : func(f) {
 
@@ -73,6 +331,8 @@ struct Optimizer {
 
 			}
 		}
+
+		findParameters();
 	}
 
 
@@ -97,46 +357,204 @@ struct Optimizer {
 					break;
 			}
 		}
+
+		findParameters();
 	}
 
 
 
 	void step() {
+
+		// the parameters the last backward pass didn't derive have no partial, they step with zeros
+		flat.refresh();
+
 		for (size_t i = 0; i < optimScalar.size(); ++i) {
 			optimScalar[i].step(scalarParameters[i]->value, scalarParameters[i]->partial);
+			scalarParameters[i]->markDirty();
 		}
 		for (size_t i = 0; i < optimVector.size(); ++i) {
 			optimVector[i].step(vectorParameters[i]->value, vectorParameters[i]->partial);
+			vectorParameters[i]->markDirty();
 		}
 		for (size_t i = 0; i < optimMatrix.size(); ++i) {
 			optimMatrix[i].step(matrixParameters[i]->value, matrixParameters[i]->partial);
+			matrixParameters[i]->markDirty();
+		}
+	}
+
+	void findParameters() {
+		flat = FlatParameters(scalarParameters, vectorParameters, matrixParameters);
+
+		for (size_t i = 0; i < scalarParameters.size(); ++i) parameterPieces[scalarParameters[i].get()] = { Node::SCALAR, i, {} };
+		for (size_t i = 0; i < vectorParameters.size(); ++i) parameterPieces[vectorParameters[i].get()] = { Node::VECTOR, i, {} };
+		for (size_t i = 0; i < matrixParameters.size(); ++i) parameterPieces[matrixParameters[i].get()] = { Node::MATRIX, i, {} };
+	}
+
+	// splits all of the elements of the parameters in a shard per thread of about the same number of elements (but at
+	// least minShardSize), going through the parameters in order: a shard can have many small parameters, and a big
+	// one is split between several shards
+	void makeShards(int threads, size_t minShardSize) {
+		size_t total = 0;
+		for (size_t i = 0; i < scalarParameters.size(); ++i) total += 1;
+		for (size_t i = 0; i < vectorParameters.size(); ++i) total += vectorParameters[i]->size;
+		for (size_t i = 0; i < matrixParameters.size(); ++i) total += matrixParameters[i]->rows * matrixParameters[i]->cols;
+
+		size_t shardSize = std::max(minShardSize, (total + threads - 1) / threads);
+
+		pieces.clear();
+		shardStarts.assign(1, 0);
+		size_t filled = 0; // in the current shard
+
+		auto cut = [&](Node::NodeTypes type, size_t index, size_t size) {
+			for (size_t begin = 0; begin < size;) {
+				size_t end = std::min(size, begin + shardSize - filled);
+				pieces.push_back({ type, index, { begin, end } });
+
+				filled += end - begin;
+				begin = end;
+
+				if (filled == shardSize) {
+					shardStarts.push_back(pieces.size());
+					filled = 0;
+				}
+			}
+		};
+
+		for (size_t i = 0; i < scalarParameters.size(); ++i) cut(Node::SCALAR, i, 1);
+		for (size_t i = 0; i < vectorParameters.size(); ++i) cut(Node::VECTOR, i, vectorParameters[i]->size);
+		for (size_t i = 0; i < matrixParameters.size(); ++i) cut(Node::MATRIX, i, matrixParameters[i]->rows * matrixParameters[i]->cols);
+
+		if (shardStarts.back() != pieces.size()) shardStarts.push_back(pieces.size());
+
+		shardThreads = threads;
+		shardMinSize = minShardSize;
+	}
+
+	// same as step, with the shards (see makeShards) updated by the OpenMP threads at the same time. The optimizers
+	// need beginStep and an update of a range of elements, like the ones here
+	void stepParallel(size_t minShardSize = 1 << 15) {
+		int threads = omp_get_max_threads();
+		if (threads != shardThreads || minShardSize != shardMinSize) makeShards(threads, minShardSize);
+
+		// see step
+		flat.refresh();
+
+		for (size_t i = 0; i < optimScalar.size(); ++i) optimScalar[i].beginStep();
+		for (size_t i = 0; i < optimVector.size(); ++i) optimVector[i].beginStep();
+		for (size_t i = 0; i < optimMatrix.size(); ++i) optimMatrix[i].beginStep();
+
+		size_t shards = shardStarts.size() - 1;
+
+		#pragma omp parallel for schedule(static) if(shards > 1)
+		for (size_t k = 0; k < shards; ++k) {
+			for (size_t j = shardStarts[k]; j < shardStarts[k + 1]; ++j) {
+				const Piece& piece = pieces[j];
+
+				switch (piece.type) {
+					case Node::SCALAR:
+						optimScalar[piece.index].update(scalarParameters[piece.index]->value, scalarParameters[piece.index]->partial, piece.range);
+						break;
+					case Node::VECTOR:
+						optimVector[piece.index].update(vectorParameters[piece.index]->value, vectorParameters[piece.index]->partial, piece.range);
+						break;
+					case Node::MATRIX:
+						optimMatrix[piece.index].update(matrixParameters[piece.index]->value, matrixParameters[piece.index]->partial, piece.range);
+						break;
+				}
+			}
 		}
+
+		for (size_t i = 0; i < scalarParameters.size(); ++i) scalarParameters[i]->markDirty();
+		for (size_t i = 0; i < vectorParameters.size(); ++i) vectorParameters[i]->markDirty();
+		for (size_t i = 0; i < matrixParameters.size(); ++i) matrixParameters[i]->markDirty();
+	}
+
+	// steps a single parameter, nothing if it isn't one of them
+	void stepParameter(const Node* node) {
+		auto it = parameterPieces.find(node);
+		if (it == parameterPieces.end()) return;
+
+		size_t i = it->second.index;
+
+		switch (it->second.type) {
+			case Node::SCALAR:
+				optimScalar[i].step(scalarParameters[i]->value, scalarParameters[i]->partial);
+				scalarParameters[i]->markDirty();
+				break;
+			case Node::VECTOR:
+				optimVector[i].step(vectorParameters[i]->value, vectorParameters[i]->partial);
+				vectorParameters[i]->markDirty();
+				break;
+			case Node::MATRIX:
+				optimMatrix[i].step(matrixParameters[i]->value, matrixParameters[i]->partial);
+				matrixParameters[i]->markDirty();
+				break;
+		}
+	}
+
+	// prepare, calculateDerivatives of func and step, but each parameter is stepped as soon as the backward pass is
+	// done with it's gradient (see GradientReady), while it's still in cache. With a BufferPool, the partials of the
+	// parameters are given back right after their step, so they don't all have to be alive at the same time (then
+	// they can't be read after it). The gradient can't be clipped by it's norm, that needs all of it
+	void fusedIteration() {
+		if (!func) return;
+
+		prepare();
+
+		GradientReady ready([this](Node* node) {
+			stepParameter(node);
+			if (BufferPool::isActive() && parameterPieces.count(node)) node->releasePartial();
+		});
+
+		func->calculateDerivatives();
 	}
 
 	void prepare() {
 		for (size_t i = 0; i < optimScalar.size(); ++i) {
 			optimScalar[i].prepare(scalarParameters[i]->value);
+			scalarParameters[i]->markDirty();
 		}
 		for (size_t i = 0; i < optimVector.size(); ++i) {
 			optimVector[i].prepare(vectorParameters[i]->value);
+			vectorParameters[i]->markDirty();
 		}
 		for (size_t i = 0; i < optimMatrix.size(); ++i) {
 			optimMatrix[i].prepare(matrixParameters[i]->value);
+			matrixParameters[i]->markDirty();
 		}
 	}
 
 
-	void optimize(int maxIter, bool verbose = false) {
+	void iterate(int iter) {
+		AllocationCheck allocations;
 
-		if (!func) return;
+		if (fuseSteps) {
+			if (maxGradientNorm > 0.0f) {
+				throw std::runtime_error("Cannot clip the gradient with fused steps");
+			}
 
-		for (int iter = 0; iter < maxIter; ++iter) {
+			fusedIteration();
+		} else {
 			prepare();
 			func->calculateDerivatives();
+			if (maxGradientNorm > 0.0f) flat.clipGradientNorm(maxGradientNorm);
 			step();
+		}
+
+		if (checkAllocationsAfter >= 0 && iter >= checkAllocationsAfter) {
+			allocations.check("An iteration of the optimizer");
+		}
+	}
+
+	void optimize(int maxIter, bool verbose = false) {
+
+		if (!func) return;
+
+		for (int iter = 0; iter < maxIter; ++iter) {
+			iterate(iter);
 
 			if (verbose && (iter + 1) % (maxIter / 10) == 0) {
-				cout << "Loss at iter " << iter + 1 << ": " << func->value << "\n";
+				printLoss(iter + 1, func->value);
 			}
 		}
 	}
@@ -150,9 +568,7 @@ struct Optimizer {
 		losses.push_back(func->value);
 
 		for (int iter = 0; iter < maxIter; ++iter) {
-			prepare();
-			func->calculateDerivatives();
-			step();
+			iterate(iter);
 
 			if ((iter + 1) % stepsBetweenSaves == 0) {
 				losses.push_back(func->value);
@@ -171,7 +587,19 @@ struct GradientDescent {
 	}
 
 	void step(T& param, const T& partial) {
-		param += partial * lr;
+		beginStep();
+		update(param, partial);
+	}
+
+	void beginStep() {}
+
+	void update(T& param, const T& partial, const ElementRange& range = ElementRange()) {
+		updateElements(param, partial, range, [lr = lr](NUM_TYPE* p, const NUM_TYPE* g, size_t n) {
+			#pragma omp simd
+			for (size_t i = 0; i < n; ++i) {
+				p[i] += g[i] * lr;
+			}
+		});
 	}
 
 	void prepare(T& param) {}
@@ -190,8 +618,20 @@ struct Momentum {
 	}
 
 	void step(T& param, const T& partial) {
-		v = v * b + partial * a;
-		param += v * -1.0f;
+		beginStep();
+		update(param, partial);
+	}
+
+	void beginStep() {}
+
+	void update(T& param, const T& partial, const ElementRange& range = ElementRange()) {
+		updateElements(param, partial, range, [a = a, b = b](NUM_TYPE* p, const NUM_TYPE* g, size_t n, NUM_TYPE* v) {
+			#pragma omp simd
+			for (size_t i = 0; i < n; ++i) {
+				v[i] = v[i] * b + g[i] * a;
+				p[i] -= v[i];
+			}
+		}, v);
 	}
 
 	void prepare(T& param) {}
@@ -283,10 +723,21 @@ struct AdaGrad {
 	}
 
 	void step(T& param, const T& partial) {
+		beginStep();
+		update(param, partial);
+	}
+
+	void beginStep() {}
 
-		G += hadamard(partial, partial);
+	void update(T& param, const T& partial, const ElementRange& range = ElementRange()) {
 
-		param += hadamard(div(-n, G), partial);
+		updateElements(param, partial, range, [n = n](NUM_TYPE* p, const NUM_TYPE* g, size_t size, NUM_TYPE* G) {
+			#pragma omp simd
+			for (size_t i = 0; i < size; ++i) {
+				G[i] += g[i] * g[i];
+				p[i] -= n / (std::sqrt(G[i]) + optimizerEpsilon) * g[i];
+			}
+		}, G);
 	}
 
 	void prepare(T& param) {}
@@ -311,17 +762,30 @@ struct Adam {
 	}
 
 	void step(T& param, const T& partial) {
+		beginStep();
+		update(param, partial);
+	}
 
+	// once per step, before updating the elements
+	void beginStep() {
 		b1_power_t *= b1;
 		b2_power_t *= b2;
+	}
 
-		m = m * b1 + partial * (1.0f - b1);
-		v = v * b2 + hadamard(partial, partial) * (1.0f - b2);
+	void update(T& param, const T& partial, const ElementRange& range = ElementRange()) {
 
-		T m_hat = m * (1.0f / (1.0f - b1_power_t));
-		T v_hat = v * (1.0f / (1.0f - b2_power_t));
+		// the bias corrections of m_hat and v_hat
+		NUM_TYPE c1 = 1.0f / (1.0f - b1_power_t);
+		NUM_TYPE c2 = 1.0f / (1.0f - b2_power_t);
 
-		param += hadamard(div(-n, v_hat), m_hat);
+		updateElements(param, partial, range, [n = n, b1 = b1, b2 = b2, c1, c2](NUM_TYPE* p, const NUM_TYPE* g, size_t size, NUM_TYPE* m, NUM_TYPE* v) {
+			#pragma omp simd
+			for (size_t i = 0; i < size; ++i) {
+				m[i] = m[i] * b1 + g[i] * (1.0f - b1);
+				v[i] = v[i] * b2 + g[i] * g[i] * (1.0f - b2);
+				p[i] -= n / (std::sqrt(v[i] * c2) + optimizerEpsilon) * (m[i] * c1);
+			}
+		}, m, v);
 	}
 
 	void prepare(T& param) {}
@@ -344,10 +808,21 @@ struct RMSProp {
 	}
 
 	void step(T& param, const T& partial) {
+		beginStep();
+		update(param, partial);
+	}
+
+	void beginStep() {}
 
-		V = V * b + hadamard(partial, partial) * (1.0f - b);
+	void update(T& param, const T& partial, const ElementRange& range = ElementRange()) {
 
-		param += hadamard(div(-a, V), partial);
+		updateElements(param, partial, range, [a = a, b = b](NUM_TYPE* p, const NUM_TYPE* g, size_t n, NUM_TYPE* V) {
+			#pragma omp simd
+			for (size_t i = 0; i < n; ++i) {
+				V[i] = V[i] * b + g[i] * g[i] * (1.0f - b);
+				p[i] -= a / (std::sqrt(V[i]) + optimizerEpsilon) * g[i];
+			}
+		}, V);
 	}
 
 	void prepare(T& param) {}
@@ -366,16 +841,564 @@ struct NAG {
 	}
 
 	void step(T& param, const T& partial) {
-		param += partial * a;
-		V = V * b + partial * a;
+		beginStep();
+		update(param, partial);
+	}
+
+	void beginStep() {}
+
+	void update(T& param, const T& partial, const ElementRange& range = ElementRange()) {
+		updateElements(param, partial, range, [a = a, b = b](NUM_TYPE* p, const NUM_TYPE* g, size_t n, NUM_TYPE* V) {
+			#pragma omp simd
+			for (size_t i = 0; i < n; ++i) {
+				p[i] += g[i] * a;
+				V[i] = V[i] * b + g[i] * a;
+			}
+		}, V);
 	}
 
 	// anticipate the next step
 	void prepare(T& param) {
-		param += V * -b;
+		updateElements(param, V, ElementRange(), [b = b](NUM_TYPE* p, const NUM_TYPE* V, size_t n) {
+			#pragma omp simd
+			for (size_t i = 0; i < n; ++i) {
+				p[i] -= V[i] * b;
+			}
+		});
 	}
 };
 
 
 
-#endif
+// for the optimizers that work on the parameters as a flat vector
+inline double flatDot(const std::vector<NUM_TYPE>& a, const std::vector<NUM_TYPE>& b) {
+	double sum = 0.0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		sum += double(a[i]) * b[i];
+	}
+
+	return sum;
+}
+
+
+
+// limited memory BFGS on all of the trainable parameters of a function, as a flat vector (see FlatParameters). For
+// smooth full batch problems (fitting curves, small physical models, ...) it needs far less evaluations than the first
+// order optimizers. The inverse of the hessian is approximated from the last few steps and changes of the gradient
+// (history of them) with the two loop recursion, and the length of each step comes from a line search that satisfies
+// the strong Wolfe conditions (Nocedal & Wright, algorithms 3.5 and 3.6). Each evaluation is calculateDerivatives of
+// the same graph, so the plan of the function is built once and only what depends on the parameters is evaluated again
+struct LBFGS {
+
+	std::shared_ptr<Scalar> func;
+	FlatParameters flat;
+
+	size_t history;
+
+	// sufficient decrease and curvature conditions of the line search
+	NUM_TYPE c1 = 1e-4f, c2 = 0.9f;
+	size_t maxLineSearch = 25;
+
+	// stops once the biggest element of the gradient is this small
+	NUM_TYPE gradientTolerance = 1e-5f;
+
+	// restarts counts the times the history was thrown away because it didn't give a descent direction
+	size_t iterations = 0, evaluations = 0, restarts = 0;
+
+	// x and the gradient there, the trial point of the line search and it's gradient, the direction
+	std::vector<NUM_TYPE> x, g, trialX, trialG, d, q;
+	NUM_TYPE fx = 0.0f, trialF = 0.0f;
+
+	// the last history pairs of s = x_k+1 - x_k and y = g_k+1 - g_k, the oldest at first
+	std::vector<std::vector<NUM_TYPE>> s, y;
+	std::vector<double> rho, alpha;
+	size_t first = 0, count = 0;
+
+	LBFGS(const std::shared_ptr<Scalar>& f, size_t h = 10) : func(f), flat(f), history(h) {
+		if (!flat.size) {
+			throw std::runtime_error("L-BFGS needs trainable parameters");
+		}
+
+		s.resize(history);
+		y.resize(history);
+		rho.resize(history);
+		alpha.resize(history);
+	}
+
+	// the function and it's gradient at x + a * d, left in trialX, trialF and trialG
+	void evaluateAt(double a) {
+		for (size_t i = 0; i < x.size(); ++i) {
+			trialX[i] = x[i] + NUM_TYPE(a) * d[i];
+		}
+
+		flat.scatterValues(trialX.data());
+		func->calculateDerivatives();
+		flat.gatherGradients(trialG.data());
+
+		trialF = func->value;
+		++evaluations;
+	}
+
+	// d = -H * g, with H the approximation of the inverse of the hessian
+	void findDirection() {
+		q = g;
+
+		for (size_t k = count; k > 0; --k) {
+			size_t i = (first + k - 1) % history;
+
+			alpha[i] = rho[i] * flatDot(s[i], q);
+			for (size_t j = 0; j < q.size(); ++j) q[j] -= NUM_TYPE(alpha[i]) * y[i][j];
+		}
+
+		// scaled like the newest pair, so the first try of the line search (a step of 1) is usually good
+		if (count) {
+			size_t newest = (first + count - 1) % history;
+			NUM_TYPE gamma = NUM_TYPE(flatDot(s[newest], y[newest]) / flatDot(y[newest], y[newest]));
+
+			for (size_t j = 0; j < q.size(); ++j) q[j] *= gamma;
+		}
+
+		for (size_t k = 0; k < count; ++k) {
+			size_t i = (first + k) % history;
+
+			double beta = rho[i] * flatDot(y[i], q);
+			for (size_t j = 0; j < q.size(); ++j) q[j] += s[i][j] * NUM_TYPE(alpha[i] - beta);
+		}
+
+		for (size_t j = 0; j < q.size(); ++j) d[j] = -q[j];
+	}
+
+	// the pair of the step from x to trialX. The oldest one is dropped once there are history of them, and pairs
+	// without a positive curvature (that the line search should prevent, but rounding may not) aren't kept
+	void remember() {
+		size_t i = (first + count) % history;
+
+		s[i].resize(x.size());
+		y[i].resize(x.size());
+		for (size_t j = 0; j < x.size(); ++j) {
+			s[i][j] = trialX[j] - x[j];
+			y[i][j] = trialG[j] - g[j];
+		}
+
+		double curvature = flatDot(s[i], y[i]);
+		if (curvature <= 0.0) return;
+
+		rho[i] = 1.0 / curvature;
+
+		if (count == history) {
+			first = (first + 1) % history;
+		} else {
+			++count;
+		}
+	}
+
+	// a step length along d satisfying the strong Wolfe conditions, evaluated last so trialX, trialF and trialG are
+	// there. False if none was found
+	bool lineSearch(double a, double slope) {
+		double previousA = 0.0, previousF = fx, previousSlope = slope;
+
+		for (size_t i = 0; i < maxLineSearch; ++i) {
+			evaluateAt(a);
+			double trialSlope = flatDot(trialG, d);
+
+			if (trialF > fx + c1 * a * slope || (i > 0 && trialF >= previousF)) {
+				return zoom(previousA, previousF, previousSlope, a, trialF, trialSlope, slope);
+			}
+
+			if (std::abs(trialSlope) <= -c2 * slope) return true;
+
+			if (trialSlope >= 0.0) {
+				return zoom(a, trialF, trialSlope, previousA, previousF, previousSlope, slope);
+			}
+
+			previousA = a;
+			previousF = trialF;
+			previousSlope = trialSlope;
+			a *= 2.0;
+		}
+
+		return false;
+	}
+
+	// the step is between low (the best one so far, satisfying sufficient decrease) and high
+	bool zoom(double low, double lowF, double lowSlope, double high, double highF, double highSlope, double slope) {
+		for (size_t i = 0; i < maxLineSearch; ++i) {
+			double a = interpolate(low, lowF, lowSlope, high, highF, highSlope);
+
+			evaluateAt(a);
+			double trialSlope = flatDot(trialG, d);
+
+			if (trialF > fx + c1 * a * slope || trialF >= lowF) {
+				high = a;
+				highF = trialF;
+				highSlope = trialSlope;
+			} else {
+				if (std::abs(trialSlope) <= -c2 * slope) return true;
+
+				if (trialSlope * (high - low) >= 0.0) {
+					high = low;
+					highF = lowF;
+					highSlope = lowSlope;
+				}
+
+				low = a;
+				lowF = trialF;
+				lowSlope = trialSlope;
+			}
+
+			if (std::abs(high - low) <= 1e-12 * std::max(1.0, std::abs(low))) break;
+		}
+
+		return false;
+	}
+
+	// the minimum of the cubic through both ends with their slopes, kept away from the ends, or the middle
+	static double interpolate(double a, double fa, double da, double b, double fb, double db) {
+		double d1 = da + db - 3.0 * (fa - fb) / (a - b);
+		double discriminant = d1 * d1 - da * db;
+
+		double lowest = std::min(a, b), highest = std::max(a, b);
+		double margin = 0.1 * (highest - lowest);
+
+		if (discriminant >= 0.0) {
+			double d2 = (b > a ? 1.0 : -1.0) * std::sqrt(discriminant);
+			double t = b - (b - a) * (db + d2 - d1) / (db - da + 2.0 * d2);
+
+			if (std::isfinite(t) && t >= lowest + margin && t <= highest - margin) return t;
+		}
+
+		return 0.5 * (a + b);
+	}
+
+	NUM_TYPE gradientSize() const {
+		NUM_TYPE biggest = 0.0f;
+		for (size_t i = 0; i < g.size(); ++i) {
+			biggest = std::max(biggest, std::abs(g[i]));
+		}
+
+		return biggest;
+	}
+
+	// runs at most maxIter iterations from the current value of the parameters, and leaves them at the best point
+	// found. Returns the value of the function there
+	NUM_TYPE minimize(size_t maxIter, bool verbose = false) {
+		func->calculateDerivatives();
+		++evaluations;
+
+		flat.gatherValues(x);
+		flat.gatherGradients(g);
+		fx = func->value;
+
+		trialX.resize(x.size());
+		trialG.resize(x.size());
+		d.resize(x.size());
+
+		for (size_t iter = 0; iter < maxIter && gradientSize() > gradientTolerance; ++iter) {
+			findDirection();
+
+			// not a descent direction (the approximation went bad), start over from the gradient
+			double slope = flatDot(g, d);
+			if (slope >= 0.0) {
+				count = first = 0;
+				++restarts;
+
+				for (size_t j = 0; j < d.size(); ++j) d[j] = -g[j];
+				slope = -flatDot(g, g);
+			}
+
+			// without history the size of the gradient says nothing about how far to go
+			double a = count ? 1.0 : std::min(1.0, 1.0 / std::sqrt(-slope));
+
+			if (!lineSearch(a, slope)) {
+				flat.scatterValues(x.data());
+
+				if (!count) break;
+
+				count = first = 0;
+				continue;
+			}
+
+			remember();
+
+			std::swap(x, trialX);
+			std::swap(g, trialG);
+			fx = trialF;
+
+			++iterations;
+
+			if (verbose) printLoss(iterations, fx);
+		}
+
+		return fx;
+	}
+};
+
+
+
+// newton's method with a trust region, for smooth problems where even L-BFGS needs too many iterations. The newton step
+// is solved with conjugate gradients (Steihaug), which only needs products of the hessian by a vector, so the hessian
+// is never built and the function isn't derived symbolically (calculateGradientFunctions builds a whole graph for
+// it): each product is a difference of gradients, H * v ~ (g(x + e * v) - g(x)) / e, one more calculateDerivatives of
+// the same graph. The step stays inside a radius that grows while the function does what the quadratic model says and
+// shrinks when it doesn't, so it works far from the minimum and with hessians that aren't positive definite.
+// For least squares, with the residuals r and func = r * r (the sum of their squares), the Gauss-Newton product
+// 2 * J^T * J * v can be used instead of the hessian: it's always positive semidefinite and only needs J * v (a
+// difference of the residuals, a forward pass) and J^T * u (the backward pass of u * r)
+struct NewtonCG {
+
+	std::shared_ptr<Scalar> func;
+	FlatParameters flat;
+
+	// for the Gauss-Newton product, weighted = weights * residuals
+	Vec residuals;
+	Vec weights;
+	Var weighted;
+
+	NUM_TYPE radius = 1.0f, maxRadius = 1e4f;
+	// the step is taken if the function goes down at least this part of what the model said
+	NUM_TYPE acceptance = 0.1f;
+	NUM_TYPE gradientTolerance = 1e-5f;
+	size_t maxConjugateGradient = 0; // the number of parameters if 0
+
+	// (g(x + e * v) - g(x - e * v)) / 2e, twice the gradients for a more accurate product
+	bool centralDifferences = false;
+
+	size_t iterations = 0, evaluations = 0, products = 0;
+
+	std::vector<NUM_TYPE> x, g, trialX, trialG;
+	std::vector<NUM_TYPE> step, residual, direction, product, shifted, shiftedResiduals;
+	NUM_TYPE fx = 0.0f;
+
+	NewtonCG(const std::shared_ptr<Scalar>& f) : func(f), flat(f) {
+		if (!flat.size) {
+			throw std::runtime_error("Newton-CG needs trainable parameters");
+		}
+	}
+
+	NewtonCG(const std::shared_ptr<Scalar>& f, const Vec& r) : NewtonCG(f) {
+		residuals = r;
+		weights = Vector::build(r->size);
+		weighted = weights * r;
+	}
+
+	bool isGaussNewton() const {
+		return residuals.ptr != nullptr;
+	}
+
+	// the function and it's gradient at the given point, the parameters are left there
+	NUM_TYPE evaluate(const std::vector<NUM_TYPE>& at, std::vector<NUM_TYPE>& gradient) {
+		flat.scatterValues(at.data());
+		func->calculateDerivatives();
+		flat.gatherGradients(gradient.data());
+
+		++evaluations;
+		return func->value;
+	}
+
+	// the size of the difference for v, about the square root (cube root for central differences) of the precision
+	// of NUM_TYPE relative to the size of x
+	double differenceStep(const std::vector<NUM_TYPE>& v) const {
+		double precision = std::numeric_limits<NUM_TYPE>::epsilon();
+		double e = centralDifferences ? std::cbrt(precision) : std::sqrt(precision);
+
+		return e * (1.0 + std::sqrt(flatDot(x, x))) / std::max(std::sqrt(flatDot(v, v)), 1e-30);
+	}
+
+	void shift(const std::vector<NUM_TYPE>& v, double e) {
+		for (size_t i = 0; i < x.size(); ++i) {
+			shifted[i] = x[i] + NUM_TYPE(e) * v[i];
+		}
+	}
+
+	// product = H * v (or the Gauss-Newton matrix)
+	void multiply(const std::vector<NUM_TYPE>& v) {
+		++products;
+		double e = differenceStep(v);
+
+		if (isGaussNewton()) {
+			// J * v from the residuals at x + e * v (and x - e * v)
+			shift(v, e);
+			flat.scatterValues(shifted.data());
+			residuals->eval();
+			shiftedResiduals = residuals->value;
+
+			shift(v, centralDifferences ? -e : 0.0);
+			flat.scatterValues(shifted.data());
+			residuals->eval();
+
+			double divisor = centralDifferences ? 2.0 * e : e;
+			for (size_t i = 0; i < shiftedResiduals.size(); ++i) {
+				weights->value[i] = NUM_TYPE((shiftedResiduals[i] - residuals->value[i]) / divisor);
+			}
+			weights->markDirty();
+
+			// J^T * (J * v) at x, which is where the parameters are now if it isn't central differences
+			if (centralDifferences) flat.scatterValues(x.data());
+			weighted->calculateDerivatives();
+			flat.gatherGradients(product.data());
+
+			for (size_t i = 0; i < product.size(); ++i) {
+				product[i] *= 2.0f;
+			}
+
+			return;
+		}
+
+		shift(v, e);
+		evaluate(shifted, product);
+
+		if (centralDifferences) {
+			shift(v, -e);
+			evaluate(shifted, trialG);
+
+			for (size_t i = 0; i < product.size(); ++i) {
+				product[i] = NUM_TYPE((product[i] - trialG[i]) / (2.0 * e));
+			}
+		} else {
+			for (size_t i = 0; i < product.size(); ++i) {
+				product[i] = NUM_TYPE((product[i] - g[i]) / e);
+			}
+		}
+	}
+
+	// the t >= 0 that puts step + t * direction on the border of the trust region
+	double toBorder() const {
+		double a = flatDot(direction, direction);
+		double b = 2.0 * flatDot(step, direction);
+		double c = flatDot(step, step) - double(radius) * radius;
+
+		return (-b + std::sqrt(std::max(0.0, b * b - 4.0 * a * c))) / (2.0 * a);
+	}
+
+	void moveStep(double t) {
+		for (size_t i = 0; i < step.size(); ++i) {
+			step[i] += NUM_TYPE(t) * direction[i];
+		}
+	}
+
+	// the step that minimizes the quadratic model g * p + p * H * p / 2 inside the trust region (Steihaug's conjugate
+	// gradients). Returns how much the model says the function goes down with it
+	double solveStep() {
+		std::fill(step.begin(), step.end(), 0.0f);
+		residual = g;
+		for (size_t i = 0; i < g.size(); ++i) direction[i] = -g[i];
+
+		double residualNorm = flatDot(residual, residual);
+		double tolerance = std::min(0.5, std::pow(residualNorm, 0.25)) * std::sqrt(residualNorm);
+		size_t maxSteps = maxConjugateGradient ? maxConjugateGradient : x.size();
+
+		// the model at step, tracked along the way: each move by t along direction changes it by
+		// t * direction * residual + t^2 * direction * H * direction / 2
+		double model = 0.0;
+
+		for (size_t k = 0; k < maxSteps; ++k) {
+			multiply(direction);
+
+			double curvature = flatDot(direction, product);
+			double slope = flatDot(direction, residual);
+
+			// negative curvature, the model goes down all the way to the border
+			if (curvature <= 0.0) {
+				double t = toBorder();
+				moveStep(t);
+				return -(model + t * slope + 0.5 * t * t * curvature);
+			}
+
+			double a = residualNorm / curvature;
+
+			double stepNorm = 0.0;
+			for (size_t i = 0; i < step.size(); ++i) {
+				double next = step[i] + a * direction[i];
+				stepNorm += next * next;
+			}
+
+			if (std::sqrt(stepNorm) >= radius) {
+				double t = toBorder();
+				moveStep(t);
+				return -(model + t * slope + 0.5 * t * t * curvature);
+			}
+
+			moveStep(a);
+			model += a * slope + 0.5 * a * a * curvature;
+
+			for (size_t i = 0; i < residual.size(); ++i) {
+				residual[i] += NUM_TYPE(a) * product[i];
+			}
+
+			double nextNorm = flatDot(residual, residual);
+			if (std::sqrt(nextNorm) < tolerance) break;
+
+			double b = nextNorm / residualNorm;
+			for (size_t i = 0; i < direction.size(); ++i) {
+				direction[i] = -residual[i] + NUM_TYPE(b) * direction[i];
+			}
+
+			residualNorm = nextNorm;
+		}
+
+		return -model;
+	}
+
+	NUM_TYPE gradientSize() const {
+		NUM_TYPE biggest = 0.0f;
+		for (size_t i = 0; i < g.size(); ++i) {
+			biggest = std::max(biggest, std::abs(g[i]));
+		}
+
+		return biggest;
+	}
+
+	// runs at most maxIter iterations from the current value of the parameters, and leaves them at the best point
+	// found. Returns the value of the function there
+	NUM_TYPE minimize(size_t maxIter, bool verbose = false) {
+		flat.gatherValues(x);
+
+		size_t n = x.size();
+		g.resize(n);
+		for (std::vector<NUM_TYPE>* v : { &trialX, &trialG, &step, &residual, &direction, &product, &shifted }) {
+			v->resize(n);
+		}
+
+		fx = evaluate(x, g);
+
+		for (size_t iter = 0; iter < maxIter && gradientSize() > gradientTolerance; ++iter) {
+			double predicted = solveStep();
+
+			for (size_t i = 0; i < n; ++i) {
+				trialX[i] = x[i] + step[i];
+			}
+
+			NUM_TYPE trialF = evaluate(trialX, trialG);
+
+			// how well the model predicted what happened
+			double agreement = predicted > 0.0 ? (double(fx) - trialF) / predicted : -1.0;
+			double stepSize = std::sqrt(flatDot(step, step));
+
+			if (agreement < 0.25) {
+				radius = NUM_TYPE(0.25 * stepSize);
+			} else if (agreement > 0.75 && stepSize >= 0.99 * radius) {
+				radius = std::min(2.0f * radius, maxRadius);
+			}
+
+			if (agreement > acceptance) {
+				std::swap(x, trialX);
+				std::swap(g, trialG);
+				fx = trialF;
+			}
+
+			++iterations;
+
+			if (verbose) printLoss(iterations, fx);
+
+			// nothing left to do at this precision
+			if (radius <= std::numeric_limits<NUM_TYPE>::epsilon() * (1.0f + std::sqrt(NUM_TYPE(flatDot(x, x))))) break;
+		}
+
+		flat.scatterValues(x.data());
+		return fx;
+	}
+};
+
+
+
+#endif
\ No newline at end of file
@@ -0,0 +1,223 @@
+#ifndef RECURRENT_HPP
+#define RECURRENT_HPP
+
+#include "operations.hpp"
+
+#include <functional>
+#include <unordered_map>
+#include <unordered_set>
+
+
+
+#ifndef NUM_TYPE
+#define NUM_TYPE NUM_TYPE
+#endif
+
+
+// truncated backpropagation through time. The graph of a chunk of steps is built once, with leaves for the input and
+// target of each step and for the state carried in from the previous chunk, and then used again for every chunk: the
+// data is copied into the leaves and only the chunk is derived. The state it ends with is copied into the state leaves
+// for the next chunk, so it carries forward but the gradient stops there. Memory and time per chunk don't depend on
+// how long the sequence is, and sequences can be fed a chunk at a time as they come (see runChunk).
+// The loss of a chunk is the sum of the loss of each step, steps without a target don't count
+struct TBPTT {
+
+	// the state after a step from the input of the step and the state before it (for an LSTM, h and c)
+	using Cell = std::function<std::vector<Vec>(const Vec& input, const std::vector<Vec>& state)>;
+	// the loss of a step from the state after it and it's target
+	using Loss = std::function<Var(const std::vector<Vec>& state, const Vec& target)>;
+
+	struct Chunk {
+		std::vector<Vec> inputs;
+		std::vector<Vec> targets;
+		std::vector<Var> weights; // 0 for the steps without a target, so the graph is the same either way
+		std::vector<Vec> initial;
+		std::vector<Vec> final;
+		Var loss;
+
+		// the leaves of the graph that aren't the ones above, what's derived when no parameters are given
+		std::vector<std::shared_ptr<Node>> wrt;
+	};
+
+	size_t length;
+	size_t inputSize, targetSize;
+	std::vector<size_t> stateSizes;
+
+	Cell cell;
+	Loss loss;
+
+	// what to derive with respect to. If empty, the leaves the cell and the loss read (the trainable ones if there are
+	// any, see Node::calculateDerivatives), the inputs, targets and states of the chunks never get a gradient
+	std::vector<std::shared_ptr<Node>> parameters;
+
+	// carried from one chunk to the next, zeros at the start of a sequence
+	std::vector<std::vector<NUM_TYPE>> state;
+
+	// by number of steps, the last chunk of a sequence can be shorter than the others
+	std::unordered_map<size_t, Chunk> chunks;
+
+	TBPTT(size_t len, size_t inSize, size_t tSize, const std::vector<size_t>& sizes, const Cell& c, const Loss& l, const std::vector<std::shared_ptr<Node>>& params = {})
+		: length(len), inputSize(inSize), targetSize(tSize), stateSizes(sizes), cell(c), loss(l), parameters(params) {
+
+		if (!length) {
+			throw std::runtime_error("TBPTT needs chunks of at least one step");
+		}
+
+		resetState();
+	}
+
+	// for the start of a new sequence
+	void resetState() {
+		state.resize(stateSizes.size());
+
+		for (size_t i = 0; i < stateSizes.size(); ++i) {
+			state[i].assign(stateSizes[i], 0.0f);
+		}
+	}
+
+	Chunk& getChunk(size_t steps) {
+		auto it = chunks.find(steps);
+		if (it != chunks.end()) return it->second;
+
+		Chunk& chunk = chunks[steps];
+
+		for (size_t i = 0; i < stateSizes.size(); ++i) {
+			chunk.initial.push_back(Vector::build(stateSizes[i]));
+		}
+
+		std::vector<Vec> current = chunk.initial;
+
+		for (size_t t = 0; t < steps; ++t) {
+			chunk.inputs.push_back(Vector::build(inputSize));
+			chunk.targets.push_back(Vector::build(targetSize));
+			chunk.weights.push_back(Scalar::build(0.0f));
+
+			current = cell(chunk.inputs[t], current);
+
+			if (current.size() != stateSizes.size()) {
+				throw std::runtime_error("The cell has to return as many states as it gets");
+			}
+
+			Var stepLoss = chunk.weights[t] * loss(current, chunk.targets[t]);
+			chunk.loss = t ? chunk.loss + stepLoss : stepLoss;
+		}
+
+		chunk.final = current;
+
+		std::unordered_set<Node*> own;
+		for (const std::vector<Vec>* leaves : { &chunk.inputs, &chunk.targets, &chunk.initial }) {
+			for (const Vec& leaf : *leaves) own.insert(leaf.ptr.get());
+		}
+		for (const Var& weight : chunk.weights) own.insert(weight.ptr.get());
+
+		std::vector<std::shared_ptr<Node>> leaves;
+		bool hasTrainable = false;
+
+		for (const std::shared_ptr<Node>& node : chunk.loss->topologicalSort(true)) {
+			if (!node->parents.size() && !node->isConstant && !own.count(node.get())) {
+				leaves.push_back(node);
+				hasTrainable = hasTrainable || node->isTrainable;
+			}
+		}
+
+		for (const std::shared_ptr<Node>& leaf : leaves) {
+			if (leaf->isTrainable || !hasTrainable) chunk.wrt.push_back(leaf);
+		}
+
+		return chunk;
+	}
+
+	// runs the next chunk of the sequence (at most length steps, one target per input, empty for the steps without one)
+	// and leaves the gradient of it's loss in the partials of the parameters. In inference mode it's only evaluated.
+	// Returns the loss of the chunk
+	NUM_TYPE runChunk(const std::vector<std::vector<NUM_TYPE>>& inputs, const std::vector<std::vector<NUM_TYPE>>& targets = {}) {
+		if (inputs.empty() || inputs.size() > length) {
+			throw std::runtime_error("A chunk needs between 1 and " + std::to_string(length) + " steps");
+		}
+
+		if (targets.size() > inputs.size()) {
+			throw std::runtime_error("A chunk can't have more targets than inputs");
+		}
+
+		for (size_t t = 0; t < inputs.size(); ++t) {
+			if (inputs[t].size() != inputSize) {
+				throw std::runtime_error("The input of step " + std::to_string(t) + " has " + std::to_string(inputs[t].size()) + " elements instead of " + std::to_string(inputSize));
+			}
+
+			if (t < targets.size() && targets[t].size() && targets[t].size() != targetSize) {
+				throw std::runtime_error("The target of step " + std::to_string(t) + " has " + std::to_string(targets[t].size()) + " elements instead of " + std::to_string(targetSize));
+			}
+		}
+
+		Chunk& chunk = getChunk(inputs.size());
+
+		for (size_t t = 0; t < inputs.size(); ++t) {
+			chunk.inputs[t]->value = inputs[t];
+			chunk.inputs[t]->markDirty();
+
+			bool hasTarget = t < targets.size() && targets[t].size();
+			if (hasTarget) {
+				chunk.targets[t]->value = targets[t];
+				chunk.targets[t]->markDirty();
+			}
+
+			if (chunk.weights[t]->value != (hasTarget ? 1.0f : 0.0f)) {
+				chunk.weights[t]->value = hasTarget ? 1.0f : 0.0f;
+				chunk.weights[t]->markDirty();
+			}
+		}
+
+		for (size_t i = 0; i < state.size(); ++i) {
+			chunk.initial[i]->value = state[i];
+			chunk.initial[i]->markDirty();
+		}
+
+		// the state is read before the backward pass, which may give the values back to the BufferPool. States the
+		// loss doesn't read (like the c of an LSTM at the last step) aren't in the plan of the loss, so they're
+		// evaluated on their own, only what the loss didn't evaluate already is calculated
+		chunk.loss->eval();
+
+		for (size_t i = 0; i < state.size(); ++i) {
+			chunk.final[i]->eval();
+			state[i] = chunk.final[i]->value;
+		}
+
+		if (!InferenceMode::isActive()) {
+			chunk.loss->calculateDerivatives(parameters.size() ? parameters : chunk.wrt);
+		}
+
+		return chunk.loss->value;
+	}
+
+	// runs a whole sequence a chunk at a time from a zero state, calling update after each chunk (like an optimizer step).
+	// Returns the sum of the losses of the chunks
+	NUM_TYPE runSequence(const std::vector<std::vector<NUM_TYPE>>& inputs, const std::vector<std::vector<NUM_TYPE>>& targets, const std::function<void()>& update = nullptr) {
+		if (targets.size() > inputs.size()) {
+			throw std::runtime_error("A sequence can't have more targets than inputs");
+		}
+
+		resetState();
+
+		NUM_TYPE total = 0.0f;
+
+		for (size_t start = 0; start < inputs.size(); start += length) {
+			size_t end = std::min(inputs.size(), start + length);
+
+			std::vector<std::vector<NUM_TYPE>> chunkInputs(inputs.begin() + start, inputs.begin() + end);
+			std::vector<std::vector<NUM_TYPE>> chunkTargets;
+
+			for (size_t t = start; t < end && t < targets.size(); ++t) {
+				chunkTargets.push_back(targets[t]);
+			}
+
+			total += runChunk(chunkInputs, chunkTargets);
+
+			if (update && !InferenceMode::isActive()) update();
+		}
+
+		return total;
+	}
+};
+
+
+#endif
@@ -26,7 +26,7 @@ struct Var {
 	Var(const std::shared_ptr<Node>& p) : ptr(std::dynamic_pointer_cast<Scalar>(p)) {}
 	template <typename T, typename = std::enable_if_t<std::is_base_of_v<Scalar, T>>>
 	Var(const std::shared_ptr<T>& p) : ptr(p) {}
-	Var(NUM_TYPE val) : ptr(std::make_shared<Scalar>(val)) {}
+	Var(NUM_TYPE val) : ptr(makeNode<Scalar>(val)) {}
 
 	Scalar* operator -> () const {
 		return ptr.get();
@@ -70,7 +70,38 @@ struct Scalar : Node {
 	}
 
 	static std::shared_ptr<Scalar> build(NUM_TYPE v = 0.0f, bool trainable = false, const std::string& n = "") {
-		return std::make_shared<Scalar>(v, n, trainable);
+		return makeNode<Scalar>(v, n, trainable);
+	}
+
+	static std::shared_ptr<Scalar> constant(NUM_TYPE v) {
+
+		NodeCache::Key key = NodeCache::key<Scalar>(v);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return std::static_pointer_cast<Scalar>(cached);
+
+		std::shared_ptr<Scalar> node = makeNode<Scalar>(v);
+		node->isConstant = true;
+		node->requiresGrad = false;
+
+		NodeCache::store(key, node);
+		return node;
+	}
+
+	// an operation on constants is a constant, so evaluate it right away and let go of it's parents
+	static std::shared_ptr<Scalar> fold(const std::shared_ptr<Scalar>& node) {
+		if (!node->hasOnlyConstantParents()) return node;
+
+		node->evaluate();
+		return constant(node->value);
+	}
+
+	bool isConstantEqualTo(NUM_TYPE v) const {
+		return isConstant && value == v;
+	}
+
+	// changes the value of a leaf, and marks it dirty so every graph that reads it sees it
+	void set(NUM_TYPE v) {
+		value = v;
+		markDirty();
 	}
 
 	void evaluate() override {
@@ -83,6 +114,34 @@ struct Scalar : Node {
 
 	void resetPartial(NUM_TYPE defaultValue = 0.0f) override final {
 		partial = defaultValue;
+		hasPartial = true;
+	}
+
+	// the first contribution in a backward pass is written, the next ones are added to it
+	void accumulatePartial(NUM_TYPE contribution) {
+		partial = hasPartial ? partial + contribution : contribution;
+		hasPartial = true;
+	}
+
+	// nothing worth pooling in a scalar
+	void releasePartial() override final {
+		hasPartial = false;
+	}
+
+	void releaseValue() override final {
+
+	}
+
+	void acquireValue() override final {
+
+	}
+
+	std::vector<std::vector<NUM_TYPE>*> valueBuffers() override final {
+		return {};
+	}
+
+	size_t hashValue() override final {
+		return std::hash<NUM_TYPE>()(value);
 	}
 
 	NodeTypes getType() override final {
@@ -94,7 +153,11 @@ struct Scalar : Node {
 	}
 
 	void resetGradientFunction(NUM_TYPE defaultValue = 0.0f) override {
-		gradientFunction = Scalar::build(defaultValue);
+		gradientFunction = Scalar::constant(defaultValue);
+	}
+
+	bool isGradientFunctionZero() override final {
+		return gradientFunction && gradientFunction->isConstantEqualTo(0.0f);
 	}
 
 
@@ -123,7 +186,7 @@ struct Scalar : Node {
 		bool trainable;
 		file.read(reinterpret_cast<char*>(&trainable), sizeof(trainable));
 
-		std::shared_ptr<Scalar> var = std::make_shared<Scalar>(0.0f, "", trainable);
+		std::shared_ptr<Scalar> var = makeNode<Scalar>(0.0f, "", trainable);
 		file.read(reinterpret_cast<char*>(&var->value), sizeof(NUM_TYPE));
 
 		return var;
@@ -0,0 +1,125 @@
+// operator new is replaced in this file only, see COUNT_ALLOCATIONS
+#define COUNT_ALLOCATIONS true
+
+#include "check.hpp"
+#include "../optimizer.hpp"
+
+#include <memory>
+
+using namespace std;
+
+
+// a small network with a scalar, vector and matrix parameters, built once like in a training loop that reuses it's graph
+struct Model {
+	Mat W1, W2;
+	Vec b1;
+	Var scale;
+	Var loss;
+
+	Model() {
+		W1 = Matrix::build(12, 3, 0.0f, true);
+		W2 = Matrix::build(1, 12, 0.0f, true);
+		b1 = Vector::build(12, 0.1f, true);
+		scale = Scalar::build(0.8f, true);
+
+		fill(W1, 0.6f, 0.0f);
+		fill(W2, 0.6f, 1.0f);
+
+		for (size_t n = 0; n < 6; ++n) {
+			Vec x = Vector::constant(3, 0.0f);
+			fill(x, 1.0f, n * 0.7f);
+
+			Var e = scale * (W2 * tanh(W1 * x + b1))->get(0) - NUM_TYPE(std::sin(n * 0.9f));
+			loss = n ? loss + e * e : e * e;
+		}
+	}
+};
+
+// the iterations after the first 2 must not allocate, iterate throws if one does
+template <template<typename> class OptimizerParam>
+bool steady(const string& name, bool pool, bool fused, NUM_TYPE rate) {
+	string what = name + (fused ? " with fused steps" : "") + (pool ? " with a BufferPool" : "");
+
+	Model model;
+	Optimizer<OptimizerParam> optimizer(model.loss, rate);
+	optimizer.fuseSteps = fused;
+	optimizer.checkAllocationsAfter = 2;
+
+	unique_ptr<BufferPool::Scope> scope;
+	if (pool) scope.reset(new BufferPool::Scope());
+
+	try {
+		for (int iter = 0; iter < 10; ++iter) {
+			optimizer.iterate(iter);
+		}
+	} catch (const std::exception& e) {
+		cout << what << ": " << e.what() << ", FAILED\n";
+		return false;
+	}
+
+	cout << what << ": no allocations\n";
+	return true;
+}
+
+// the same with stepParallel, which optimize doesn't use
+template <template<typename> class OptimizerParam>
+bool steadyParallel(const string& name, bool pool, NUM_TYPE rate) {
+	string what = name + " with the parallel step" + (pool ? " with a BufferPool" : "");
+
+	Model model;
+	Optimizer<OptimizerParam> optimizer(model.loss, rate);
+
+	unique_ptr<BufferPool::Scope> scope;
+	if (pool) scope.reset(new BufferPool::Scope());
+
+	size_t allocations = 0;
+	for (int iter = 0; iter < 10; ++iter) {
+		AllocationCheck check;
+
+		optimizer.prepare();
+		model.loss->calculateDerivatives();
+		optimizer.stepParallel(4);
+
+		if (iter >= 2) allocations += check.allocations();
+	}
+
+	cout << what << ": " << (allocations ? "allocated memory, FAILED" : "no allocations") << "\n";
+	return !allocations;
+}
+
+template <template<typename> class OptimizerParam>
+bool steady(const string& name, NUM_TYPE rate) {
+	bool ok = true;
+
+	for (bool pool : { false, true }) {
+		for (bool fused : { false, true }) {
+			ok = steady<OptimizerParam>(name, pool, fused, rate) && ok;
+		}
+
+		ok = steadyParallel<OptimizerParam>(name, pool, rate) && ok;
+	}
+
+	return ok;
+}
+
+
+int main() {
+
+	// the counter has to see the allocations of building a graph, or this checks nothing
+	AllocationCheck building;
+	Model model;
+
+	if (!building.allocations()) {
+		cout << "Allocations aren't counted\n";
+		return report("Allocations", false);
+	}
+
+	bool ok = steady<GradientDescent>("GradientDescent", 0.01f);
+	ok = steady<Momentum>("Momentum", 0.01f) && ok;
+	ok = steady<AdaGrad>("AdaGrad", 0.01f) && ok;
+	ok = steady<Adam>("Adam", 0.01f) && ok;
+	ok = steady<RMSProp>("RMSProp", 0.01f) && ok;
+	ok = steady<NAG>("NAG", 0.001f) && ok;
+
+	return report("Allocations", ok);
+}
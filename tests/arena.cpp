@@ -0,0 +1,86 @@
+#include "check.hpp"
+#include "../optimizer.hpp"
+
+using namespace std;
+
+
+// an LSTM-like cell unrolled over a short sequence, built again on every iteration of the training loop
+struct Model {
+	Mat Wf, Uf, Wi, Ui, Wc, Uc, V;
+	Vec bf, bi, bc;
+
+	Model(size_t hidden) {
+		for (Mat* W : { &Wf, &Wi, &Wc }) *W = Matrix::build(hidden, 1, 0.0f, true);
+		for (Mat* U : { &Uf, &Ui, &Uc }) *U = Matrix::build(hidden, hidden, 0.0f, true);
+		for (Vec* b : { &bf, &bi, &bc }) *b = Vector::build(hidden, 0.1f, true);
+		V = Matrix::build(1, hidden, 0.0f, true);
+
+		NUM_TYPE seed = 0.0f;
+		for (Mat* m : { &Wf, &Uf, &Wi, &Ui, &Wc, &Uc, &V }) {
+			fill(*m, 0.5f / std::sqrt(NUM_TYPE((*m)->cols)), seed++);
+		}
+	}
+
+	vector<shared_ptr<Node>> parameters() {
+		return { Wf, Uf, Wi, Ui, Wc, Uc, V, bf, bi, bc };
+	}
+
+	Var loss(size_t iteration) {
+		Vec h = Vector::constant(bf->size, 0.0f), c = h;
+
+		for (size_t t = 0; t < 24; ++t) {
+			Vec x = Vector::constant(1, NUM_TYPE(std::sin(iteration * 0.5f + t * 0.2f)));
+
+			Vec f = sigmoid(Wf * x + Uf * h + bf);
+			Vec i = sigmoid(Wi * x + Ui * h + bi);
+			c = hadamard(f, c) + hadamard(i, tanh(Wc * x + Uc * h + bc));
+			h = tanh(c);
+		}
+
+		Vec e = V * h - Vector::constant(1, iteration % 2 ? 0.5f : -0.5f);
+		return e * e;
+	}
+};
+
+// the losses of each iteration, then the parameters
+vector<NUM_TYPE> train(bool arena, size_t iterations) {
+	Model model(12);
+	Optimizer<Adam> optimizer(model.parameters(), 0.01f);
+
+	vector<NUM_TYPE> result;
+
+	// the buffers of the graphs go back to the pool when their nodes are gone, for the next ones
+	BufferPool::Scope pool;
+
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		std::unique_ptr<NodeArena::Scope> scope;
+		if (arena) scope.reset(new NodeArena::Scope());
+
+		Var loss = model.loss(iter);
+		loss->calculateDerivatives();
+		optimizer.step();
+
+		result.push_back(loss->value);
+	}
+
+	vector<NUM_TYPE> values = flatten(model.parameters(), false);
+	result.insert(result.end(), values.begin(), values.end());
+
+	return result;
+}
+
+
+int main() {
+
+	vector<NUM_TYPE> expected = train(false, 100);
+	size_t chunks = NodeArena::chunks.size();
+
+	bool ok = compare("Losses and parameters after 100 iterations with a NodeArena", train(true, 100), expected);
+
+	// every graph fits in the chunks the first ones used
+	size_t used = NodeArena::chunks.size() - chunks;
+	cout << "Arena chunks: " << used << "\n";
+	ok = ok && used > 0 && used <= 4;
+
+	return report("NodeArena", ok);
+}
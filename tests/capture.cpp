@@ -0,0 +1,116 @@
+#include "check.hpp"
+#include "../capture.hpp"
+
+using namespace std;
+
+
+struct Model {
+	Mat W, U;
+	Vec b, V;
+
+	Model(size_t hidden, size_t inputSize) {
+		W = Matrix::build(hidden, inputSize, 0.0f, true);
+		U = Matrix::build(hidden, hidden, 0.0f, true);
+		b = Vector::build(hidden, 0.1f, true);
+		V = Vector::build(hidden, 0.0f, true);
+
+		fill(W, 0.5f, 1.0f);
+		fill(U, 0.4f / hidden, 2.0f);
+		fill(V, 1.0f, 3.0f);
+	}
+
+	vector<shared_ptr<Node>> parameters() {
+		return { W, U, b, V };
+	}
+
+	// a layer and a squared error against the target
+	Var loss(const Vec& x, const Vec& target) {
+		Var out = V * tanh(W * x + b);
+		Var e = out - target->get(0);
+
+		return e * e;
+	}
+
+	// a recurrent layer over the steps and the squared error of the last state, only the steps where the mask is 1 count
+	Var sequenceLoss(const vector<Vec>& steps, const Vec& mask, const Vec& target) {
+		Vec h = Vector::constant(b->size, 0.0f);
+
+		for (size_t t = 0; t < steps.size(); ++t) {
+			Vec next = tanh(W * steps[t] + U * h + b);
+			h = mask.ptr ? maskedUpdate(h, next, mask->get(t)) : next;
+		}
+
+		Var e = V * h - target->get(0);
+		return e * e;
+	}
+};
+
+vector<NUM_TYPE> makeData(size_t size, size_t seed) {
+	vector<NUM_TYPE> data(size);
+	for (size_t i = 0; i < size; ++i) data[i] = NUM_TYPE(std::sin(seed * 1.7f + i * 0.3f));
+
+	return data;
+}
+
+
+int main() {
+
+	Model model(16, 3);
+	bool ok = true;
+
+	// the same shapes every time, only the first call builds a graph. The weights change between calls, like in training
+	GraphCapture capture;
+
+	for (size_t k = 0; k < 20; ++k) {
+		vector<NUM_TYPE> x = makeData(3, k), target = makeData(1, k + 100);
+
+		Var fresh = model.loss(Vector::constant(x), Vector::constant(target));
+		fresh->calculateDerivatives();
+		NUM_TYPE expectedLoss = fresh->value;
+		vector<NUM_TYPE> expected = flatten(model.parameters());
+
+		Var replayed = capture.replay({ x, target }, [&](const vector<Vec>& inputs) { return model.loss(inputs[0], inputs[1]); });
+		replayed->calculateDerivatives();
+		ok = compare("Replay " + to_string(k), replayed->value, flatten(model.parameters()), expectedLoss, expected) && ok;
+
+		model.W->value[k % 16][k % 3] += 0.01f;
+		model.W->markDirty();
+	}
+
+	cout << "Replay: " << capture.hits << " hits, " << capture.misses << " misses\n";
+	ok = ok && capture.misses == 1 && capture.hits == 19;
+
+	// sequences of different lengths, padded to multiples of 4 and masked, against an unmasked graph of the exact
+	// length. The padded graphs add the partials in another order, so those are only the same up to rounding
+	GraphCapture sequences(2, GraphCapture::multiplesOf(4));
+
+	for (size_t k = 0; k < 24; ++k) {
+		size_t length = 1 + (k * 5) % 11;
+
+		vector<vector<NUM_TYPE>> steps;
+		vector<Vec> freshSteps;
+		for (size_t t = 0; t < length; ++t) {
+			steps.push_back(makeData(3, k * 31 + t));
+			freshSteps.push_back(Vector::constant(steps[t]));
+		}
+
+		vector<NUM_TYPE> target = makeData(1, k + 200);
+
+		Var fresh = model.sequenceLoss(freshSteps, Vec(), Vector::constant(target));
+		fresh->calculateDerivatives();
+		NUM_TYPE expectedLoss = fresh->value;
+		vector<NUM_TYPE> expected = flatten(model.parameters());
+
+		Var replayed = sequences.replaySequence(steps, { target }, [&](const vector<Vec>& inputs, const Vec& mask, const vector<Vec>& others) {
+			return model.sequenceLoss(inputs, mask, others[0]);
+		});
+		replayed->calculateDerivatives();
+
+		ok = compare("Sequence of " + to_string(length), replayed->value, flatten(model.parameters()), expectedLoss, expected, 1e-5f) && ok;
+		ok = ok && sequences.graphs.size() <= 2;
+	}
+
+	cout << "Sequences: " << sequences.hits << " hits, " << sequences.misses << " misses, " << sequences.graphs.size() << " graphs kept\n";
+
+	return report("Capture", ok);
+}
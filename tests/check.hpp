@@ -0,0 +1,139 @@
+#ifndef CHECK_HPP
+#define CHECK_HPP
+
+#include "../scalar.hpp"
+#include "../vector.hpp"
+#include "../matrix.hpp"
+#include "../operations.hpp"
+
+#include <iostream>
+#include <string>
+#include <cmath>
+
+
+
+#ifndef NUM_TYPE
+#define NUM_TYPE NUM_TYPE
+#endif
+
+
+// shared by the checks in this directory. Each one compares a feature against the plain way of getting the same
+// result (the whole backward pass, a graph built again, a sequential step, ...), prints what it compared and exits
+// with 1 if anything was different
+
+
+// deterministic values for a weight, different for each seed and not all of the same sign
+inline void fill(const std::shared_ptr<Node>& node, NUM_TYPE scale, NUM_TYPE seed) {
+	size_t k = 0;
+	auto next = [&]() { return NUM_TYPE(scale * std::sin(seed + 0.37f * k++)); };
+
+	switch (node->getType()) {
+		case Node::SCALAR:
+			std::static_pointer_cast<Scalar>(node)->value = next();
+			break;
+		case Node::VECTOR:
+			for (NUM_TYPE& x : std::static_pointer_cast<Vector>(node)->value) x = next();
+			break;
+		case Node::MATRIX:
+			for (std::vector<NUM_TYPE>& row : std::static_pointer_cast<Matrix>(node)->value) {
+				for (NUM_TYPE& x : row) x = next();
+			}
+			break;
+	}
+
+	node->markDirty();
+}
+
+// the values or the partials of the nodes one after the other, matrices row by row. A partial that was never
+// allocated counts as zeros
+inline std::vector<NUM_TYPE> flatten(const std::vector<std::shared_ptr<Node>>& nodes, bool partials = true) {
+	std::vector<NUM_TYPE> flat;
+
+	for (const std::shared_ptr<Node>& node : nodes) {
+		switch (node->getType()) {
+			case Node::SCALAR: {
+				Scalar* s = static_cast<Scalar*>(node.get());
+				flat.push_back(partials ? s->partial : s->value);
+				break;
+			}
+			case Node::VECTOR: {
+				Vector* v = static_cast<Vector*>(node.get());
+				const std::vector<NUM_TYPE>& x = partials ? v->partial : v->value;
+
+				if (x.empty()) flat.resize(flat.size() + v->size, 0.0f);
+				else flat.insert(flat.end(), x.begin(), x.end());
+				break;
+			}
+			case Node::MATRIX: {
+				Matrix* m = static_cast<Matrix*>(node.get());
+				const std::vector<std::vector<NUM_TYPE>>& x = partials ? m->partial : m->value;
+
+				for (size_t i = 0; i < m->rows; ++i) {
+					if (i < x.size() && x[i].size()) flat.insert(flat.end(), x[i].begin(), x[i].end());
+					else flat.resize(flat.size() + m->cols, 0.0f);
+				}
+				break;
+			}
+		}
+	}
+
+	return flat;
+}
+
+// sqrt(sum (a - b)^2 / sum b^2), in double
+inline NUM_TYPE relativeError(const std::vector<NUM_TYPE>& a, const std::vector<NUM_TYPE>& b) {
+	if (a.size() != b.size()) return NUM_TYPE(INFINITY);
+
+	double difference = 0.0, size = 0.0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		difference += double(a[i] - b[i]) * (a[i] - b[i]);
+		size += double(b[i]) * b[i];
+	}
+
+	return NUM_TYPE(size > 0.0 ? std::sqrt(difference / size) : std::sqrt(difference));
+}
+
+inline bool finite(const std::vector<NUM_TYPE>& a) {
+	for (NUM_TYPE x : a) {
+		if (!std::isfinite(x)) return false;
+	}
+
+	return true;
+}
+
+// a loss and a gradient against the expected ones, exactly the same unless given a tolerance (relative). nan is never
+// the same as anything
+inline bool compare(const std::string& what, NUM_TYPE loss, const std::vector<NUM_TYPE>& g, NUM_TYPE expectedLoss, const std::vector<NUM_TYPE>& expected, NUM_TYPE tolerance = 0.0f) {
+	bool ok;
+	if (tolerance == 0.0f) {
+		ok = loss == expectedLoss && g == expected;
+	} else {
+		ok = std::abs(loss - expectedLoss) <= tolerance * std::abs(expectedLoss) && relativeError(g, expected) <= tolerance;
+	}
+
+	ok = ok && finite(g) && std::isfinite(loss);
+
+	std::cout << what << ": loss " << loss << " against " << expectedLoss;
+	if (tolerance != 0.0f) std::cout << ", relative error of the gradient " << relativeError(g, expected);
+	std::cout << (ok ? "" : ", DIFFERENT") << "\n";
+
+	return ok;
+}
+
+// a sequence of values (losses, parameters, ...) against the expected one, exactly
+inline bool compare(const std::string& what, const std::vector<NUM_TYPE>& a, const std::vector<NUM_TYPE>& expected) {
+	bool ok = a == expected && finite(expected);
+
+	std::cout << what << ": " << (ok ? "the same" : (finite(expected) ? "DIFFERENT" : "NOT FINITE")) << "\n";
+
+	return ok;
+}
+
+// the last line of a check, and it's exit code
+inline int report(const std::string& name, bool ok) {
+	std::cout << name << (ok ? " ok" : " FAILED") << "\n";
+
+	return ok ? 0 : 1;
+}
+
+#endif
@@ -0,0 +1,83 @@
+#include "check.hpp"
+
+using namespace std;
+
+
+// a recurrent layer unrolled over a long sequence, the kind of graph checkpointing is for
+struct Model {
+	Mat W, U, V;
+	Vec b, h0;
+	vector<Vec> inputs;
+
+	Model(size_t hidden, size_t inputSize, size_t length) {
+		W = Matrix::build(hidden, inputSize, 0.0f, true);
+		U = Matrix::build(hidden, hidden, 0.0f, true);
+		V = Matrix::build(1, hidden, 0.0f, true);
+		b = Vector::build(hidden, 0.1f, true);
+		h0 = Vector::build(hidden, 0.05f, true);
+
+		fill(W, 0.5f, 1.0f);
+		fill(U, 0.3f / hidden, 2.0f);
+		fill(V, 1.0f / hidden, 3.0f);
+
+		for (size_t t = 0; t < length; ++t) {
+			inputs.push_back(Vector::constant(inputSize, 0.0f));
+			fill(inputs[t], 1.0f, t * 0.1f);
+		}
+	}
+
+	vector<shared_ptr<Node>> parameters() {
+		return { W, U, V, b, h0 };
+	}
+
+	// with a checkpoint on the state every checkpointEvery steps if it isn't 0
+	Var loss(size_t checkpointEvery = 0) {
+		Vec h = h0;
+		Var total;
+
+		for (size_t t = 0; t < inputs.size(); ++t) {
+			h = tanh(W * inputs[t] + U * h + b);
+			if (checkpointEvery && (t + 1) % checkpointEvery == 0) h = checkpoint(h);
+
+			Vec out = V * h;
+			total = t ? total + out * out : out * out;
+		}
+
+		return total;
+	}
+};
+
+
+int main() {
+
+	Model model(32, 3, 400);
+
+	// the whole backward pass
+	Var loss = model.loss();
+	loss->calculateDerivatives();
+	NUM_TYPE expectedLoss = loss->value;
+	vector<NUM_TYPE> expected = flatten(model.parameters());
+
+	bool ok = true;
+
+	// sqrt(N) segments, on the same graph
+	{
+		Checkpointing checkpointing;
+		loss->calculateDerivatives();
+		ok = compare("Checkpointing", loss->value, flatten(model.parameters()), expectedLoss, expected) && ok;
+	}
+
+	// segments chosen by hand, with and without a BufferPool giving the dropped values back
+	Var checkpointed = model.loss(20);
+	checkpointed->calculateDerivatives();
+	ok = compare("checkpoint() every 20 steps", checkpointed->value, flatten(model.parameters()), expectedLoss, expected) && ok;
+
+	{
+		BufferPool::Scope pool;
+		Var pooled = model.loss(20);
+		pooled->calculateDerivatives();
+		ok = compare("checkpoint() every 20 steps with a BufferPool", pooled->value, flatten(model.parameters()), expectedLoss, expected) && ok;
+	}
+
+	return report("Checkpointing", ok);
+}
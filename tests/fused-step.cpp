@@ -0,0 +1,89 @@
+#include "check.hpp"
+#include "../optimizer.hpp"
+
+using namespace std;
+
+
+// a recurrent layer over a sequence, long enough for a few segments with Checkpointing, and a loss on every state
+struct Model {
+	Mat W, U, V;
+	Vec b;
+	Var scale;
+	Var loss;
+
+	Model(size_t hidden, size_t length) {
+		W = Matrix::build(hidden, 2, 0.0f, true);
+		U = Matrix::build(hidden, hidden, 0.0f, true);
+		V = Matrix::build(1, hidden, 0.0f, true);
+		b = Vector::build(hidden, 0.1f, true);
+		scale = Scalar::build(0.5f, true);
+
+		fill(W, 0.5f, 1.0f);
+		fill(U, 0.4f / hidden, 2.0f);
+		fill(V, 1.0f / hidden, 3.0f);
+
+		Vec h = Vector::constant(hidden, 0.0f);
+
+		for (size_t t = 0; t < length; ++t) {
+			Vec x = Vector::constant({ NUM_TYPE(std::sin(t * 0.1f)), NUM_TYPE(std::cos(t * 0.37f)) });
+			h = tanh(W * x + U * h + b);
+
+			Var e = scale * (V * h)->get(0) - NUM_TYPE(std::cos(t * 0.2f));
+			loss = t ? loss + e * e : e * e;
+		}
+	}
+
+	vector<shared_ptr<Node>> parameters() {
+		return { W, U, V, b, scale };
+	}
+};
+
+enum Mode { PLAIN, FUSED, FUSED_POOL, FUSED_CHECKPOINTING };
+
+// the loss after each iteration, then the parameters
+template <template<typename> class OptimizerParam>
+vector<NUM_TYPE> train(Mode mode, size_t iterations) {
+	Model model(16, 60);
+	Optimizer<OptimizerParam> optimizer(model.loss, NUM_TYPE(0.001f));
+	optimizer.fuseSteps = mode != PLAIN;
+
+	std::unique_ptr<BufferPool::Scope> pool;
+	if (mode == FUSED_POOL) pool.reset(new BufferPool::Scope());
+
+	std::unique_ptr<Checkpointing> checkpointing;
+	if (mode == FUSED_CHECKPOINTING) checkpointing.reset(new Checkpointing());
+
+	vector<NUM_TYPE> result;
+
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		optimizer.iterate(int(iter));
+		result.push_back(model.loss->value);
+	}
+
+	vector<NUM_TYPE> values = flatten(model.parameters(), false);
+	result.insert(result.end(), values.begin(), values.end());
+
+	return result;
+}
+
+// the rate is small enough that none of them diverge
+template <template<typename> class OptimizerParam>
+bool same(const string& name) {
+	vector<NUM_TYPE> expected = train<OptimizerParam>(PLAIN, 40);
+
+	bool ok = compare(name + " with fused steps", train<OptimizerParam>(FUSED, 40), expected);
+	ok = compare(name + " with fused steps and a BufferPool", train<OptimizerParam>(FUSED_POOL, 40), expected) && ok;
+	ok = compare(name + " with fused steps and Checkpointing", train<OptimizerParam>(FUSED_CHECKPOINTING, 40), expected) && ok;
+
+	return ok;
+}
+
+
+int main() {
+
+	bool ok = same<Adam>("Adam");
+	ok = same<Momentum>("Momentum") && ok;
+	ok = same<NAG>("NAG") && ok;
+
+	return report("Fused steps", ok);
+}
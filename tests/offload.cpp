@@ -0,0 +1,100 @@
+#include "check.hpp"
+
+using namespace std;
+
+
+// a wide elementwise recurrence, every state is big enough to be spilled
+struct Model {
+	Vec w, x;
+	size_t length;
+
+	Model(size_t size, size_t l) : length(l) {
+		w = Vector::build(size, 0.0f, true);
+		x = Vector::build(size, 0.0f, true);
+
+		fill(w, 0.9f, 1.5f);
+		fill(x, 0.1f, 0.0f);
+	}
+
+	vector<shared_ptr<Node>> parameters() {
+		return { w, x };
+	}
+
+	Var loss() {
+		Vec h = x;
+		for (size_t t = 0; t < length; ++t) {
+			h = tanh(hadamard(h, w) + x);
+		}
+
+		return sum(h);
+	}
+};
+
+// buffers spilled to the file, some prefetched and some not, come back the same
+bool roundTrip() {
+	SpillFile file("offload.spill", (size_t) 1 << 30);
+
+	vector<vector<vector<NUM_TYPE>>> data(4);
+	for (size_t k = 0; k < data.size(); ++k) {
+		data[k] = { vector<NUM_TYPE>(3000 + k * 1000), vector<NUM_TYPE>(17) };
+		for (size_t i = 0; i < data[k][0].size(); ++i) data[k][0][i] = NUM_TYPE(k * 100000 + i);
+		for (size_t i = 0; i < data[k][1].size(); ++i) data[k][1][i] = -NUM_TYPE(i);
+	}
+
+	vector<vector<vector<NUM_TYPE>>> buffers = data;
+	vector<size_t> ids;
+	for (size_t k = 0; k < buffers.size(); ++k) {
+		ids.push_back(file.spill({ &buffers[k][0], &buffers[k][1] }, k * 10));
+	}
+
+	file.prefetchFrom(20);
+
+	bool ok = true;
+	for (size_t k = buffers.size(); k > 0; --k) {
+		file.restore(ids[k - 1], { &buffers[k - 1][0], &buffers[k - 1][1] });
+		ok = ok && buffers[k - 1] == data[k - 1];
+	}
+
+	file.reset();
+
+	cout << "Spill file round trip: " << file.spilledBytes / 1024 << " KB" << (ok ? ", same data back" : ", DIFFERENT data back") << "\n";
+
+	return ok;
+}
+
+
+int main() {
+
+	Model model(4096, 100);
+
+	Var loss = model.loss();
+	loss->calculateDerivatives();
+	NUM_TYPE expectedLoss = loss->value;
+	vector<NUM_TYPE> expected = flatten(model.parameters());
+
+	bool ok = roundTrip();
+
+	// only passes if something was spilled at all
+	{
+		BufferPool::Scope pool;
+		Offload offload("offload.spill", 8);
+
+		Var offloaded = model.loss();
+		offloaded->calculateDerivatives();
+		ok = compare("Offload", offloaded->value, flatten(model.parameters()), expectedLoss, expected) && ok;
+		ok = ok && offload.file.spilledBytes > 0;
+	}
+
+	{
+		BufferPool::Scope pool;
+		Checkpointing checkpointing;
+		Offload offload("offload.spill", 2);
+
+		Var offloaded = model.loss();
+		offloaded->calculateDerivatives();
+		ok = compare("Offload with Checkpointing", offloaded->value, flatten(model.parameters()), expectedLoss, expected) && ok;
+		ok = ok && offload.file.spilledBytes > 0;
+	}
+
+	return report("Offload", ok);
+}
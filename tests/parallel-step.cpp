@@ -0,0 +1,86 @@
+#include "check.hpp"
+#include "../optimizer.hpp"
+
+#include <omp.h>
+
+using namespace std;
+
+
+// a small network with a scalar, vector and matrix parameters of sizes that don't split evenly in shards
+struct Model {
+	Mat W1, W2;
+	Vec b1;
+	Var scale;
+	Var loss;
+
+	Model() {
+		W1 = Matrix::build(19, 5, 0.0f, true);
+		W2 = Matrix::build(1, 19, 0.0f, true);
+		b1 = Vector::build(19, 0.1f, true);
+		scale = Scalar::build(0.8f, true);
+
+		fill(W1, 0.6f, 0.0f);
+		fill(W2, 0.6f, 1.0f);
+
+		for (size_t n = 0; n < 8; ++n) {
+			Vec x = Vector::constant(5, 0.0f);
+			fill(x, 1.0f, n * 0.7f);
+
+			Var e = scale * (W2 * tanh(W1 * x + b1))->get(0) - NUM_TYPE(std::sin(n * 0.9f));
+			loss = n ? loss + e * e : e * e;
+		}
+	}
+
+	vector<shared_ptr<Node>> parameters() {
+		return { W1, W2, b1, scale };
+	}
+};
+
+// the loss after each iteration, then the parameters
+template <template<typename> class OptimizerParam>
+vector<NUM_TYPE> train(bool parallel, size_t iterations, NUM_TYPE rate) {
+	Model model;
+	Optimizer<OptimizerParam> optimizer(model.loss, rate);
+
+	vector<NUM_TYPE> result;
+
+	for (size_t iter = 0; iter < iterations; ++iter) {
+		optimizer.prepare();
+		model.loss->calculateDerivatives();
+
+		if (parallel) {
+			optimizer.stepParallel(7);
+		} else {
+			optimizer.step();
+		}
+
+		result.push_back(model.loss->value);
+	}
+
+	vector<NUM_TYPE> values = flatten(model.parameters(), false);
+	result.insert(result.end(), values.begin(), values.end());
+
+	return result;
+}
+
+// with a rate small enough that it doesn't diverge
+template <template<typename> class OptimizerParam>
+bool same(const string& name, NUM_TYPE rate) {
+	return compare(name + " with the parallel step", train<OptimizerParam>(true, 50, rate), train<OptimizerParam>(false, 50, rate));
+}
+
+
+int main() {
+
+	// shards of at least 7 elements, so most parameters are split between threads
+	omp_set_num_threads(4);
+
+	bool ok = same<GradientDescent>("GradientDescent", 0.01f);
+	ok = same<Momentum>("Momentum", 0.01f) && ok;
+	ok = same<AdaGrad>("AdaGrad", 0.01f) && ok;
+	ok = same<Adam>("Adam", 0.01f) && ok;
+	ok = same<RMSProp>("RMSProp", 0.01f) && ok;
+	ok = same<NAG>("NAG", 0.001f) && ok;
+
+	return report("Parallel step", ok);
+}
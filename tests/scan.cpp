@@ -0,0 +1,107 @@
+#include "check.hpp"
+
+using namespace std;
+
+
+// a recurrent layer over a sequence, with the loss reading every state
+struct Model {
+	Mat W, U, V, X;
+	Vec b, h0;
+
+	Model(size_t hidden, size_t length) {
+		W = Matrix::build(hidden, 2, 0.0f, true);
+		U = Matrix::build(hidden, hidden, 0.0f, true);
+		V = Matrix::build(1, hidden, 0.0f, true);
+		X = Matrix::build(length, 2, 0.0f, true);
+		b = Vector::build(hidden, 0.1f, true);
+		h0 = Vector::build(hidden, 0.05f, true);
+
+		fill(W, 0.5f, 1.0f);
+		fill(U, 0.4f / hidden, 2.0f);
+		fill(V, 1.0f / hidden, 3.0f);
+		fill(X, 1.0f, 4.0f);
+	}
+
+	vector<shared_ptr<Node>> parameters() {
+		return { W, U, V, X, b, h0 };
+	}
+
+	Vec cell(const Vec& x, const Vec& h) {
+		return tanh(W * x + U * h + b);
+	}
+
+	Var loss(const vector<Vec>& states) {
+		Var total;
+		for (size_t t = 0; t < states.size(); ++t) {
+			Vec out = V * states[t];
+			total = t ? total + out * out : out * out;
+		}
+
+		return total;
+	}
+
+	vector<Vec> unrolled() {
+		vector<Vec> states;
+
+		Vec h = h0;
+		for (size_t t = 0; t < X->rows; ++t) {
+			h = cell(X[t], h);
+			states.push_back(h);
+		}
+
+		return states;
+	}
+
+	vector<Vec> scanned() {
+		Mat S = scan([this](const Vec& x, const Vec& h) { return cell(x, h); }, h0, X);
+
+		vector<Vec> states;
+		for (size_t t = 0; t < X->rows; ++t) {
+			states.push_back(S[t]);
+		}
+
+		return states;
+	}
+};
+
+
+int main() {
+
+	Model model(24, 200);
+
+	vector<Vec> unrolled = model.unrolled();
+	Var expectedLoss = model.loss(unrolled);
+	expectedLoss->calculateDerivatives();
+	vector<NUM_TYPE> expected = flatten(model.parameters());
+
+	vector<Vec> scanned = model.scanned();
+	Var loss = model.loss(scanned);
+	loss->calculateDerivatives();
+
+	// the states themselves
+	vector<NUM_TYPE> states = flatten(vector<shared_ptr<Node>>(scanned.begin(), scanned.end()), false);
+	vector<NUM_TYPE> expectedStates = flatten(vector<shared_ptr<Node>>(unrolled.begin(), unrolled.end()), false);
+
+	bool ok = compare("States", states, expectedStates);
+
+	ok = compare("Scan", loss->value, flatten(model.parameters()), expectedLoss->value, expected) && ok;
+
+	// deriving the same graph again, after a change of the weights
+	model.U->value[3][5] += 0.1f;
+	model.U->markDirty();
+
+	expectedLoss->calculateDerivatives();
+	expected = flatten(model.parameters());
+	loss->calculateDerivatives();
+	ok = compare("Scan after changing a weight", loss->value, flatten(model.parameters()), expectedLoss->value, expected) && ok;
+
+	{
+		BufferPool::Scope pool;
+
+		Var pooled = model.loss(model.scanned());
+		pooled->calculateDerivatives();
+		ok = compare("Scan with a BufferPool", pooled->value, flatten(model.parameters()), expectedLoss->value, expected) && ok;
+	}
+
+	return report("Scan", ok);
+}
@@ -0,0 +1,140 @@
+#include "check.hpp"
+#include "../recurrent.hpp"
+
+using namespace std;
+
+
+// a recurrent layer with a linear readout, and a target every third step
+struct Model {
+	Mat W, U, V;
+	Vec b;
+	vector<vector<NUM_TYPE>> inputs, targets;
+
+	Model(size_t hidden, size_t length, bool trainable = true) {
+		W = Matrix::build(hidden, 2, 0.0f, trainable);
+		U = Matrix::build(hidden, hidden, 0.0f, trainable);
+		V = Matrix::build(1, hidden, 0.0f, trainable);
+		b = Vector::build(hidden, 0.1f, trainable);
+
+		fill(W, 0.5f, 1.0f);
+		fill(U, 0.4f / hidden, 2.0f);
+		fill(V, 1.0f / hidden, 3.0f);
+
+		for (size_t t = 0; t < length; ++t) {
+			inputs.push_back({ NUM_TYPE(std::sin(t * 0.1f)), NUM_TYPE(std::cos(t * 0.37f)) });
+			targets.push_back(t % 3 ? vector<NUM_TYPE>() : vector<NUM_TYPE>{ NUM_TYPE(std::cos(t * 0.1f)) });
+		}
+	}
+
+	vector<shared_ptr<Node>> parameters() {
+		return { W, U, V, b };
+	}
+
+	Vec cell(const Vec& x, const Vec& h) {
+		return tanh(W * x + U * h + b);
+	}
+
+	Var loss(const Vec& h, const Vec& target) {
+		Vec e = V * h - target;
+		return e * e;
+	}
+
+	// the loss of steps [begin, end) unrolled from the given state, and it's gradient. Leaves the state after them in state
+	NUM_TYPE unroll(size_t begin, size_t end, vector<NUM_TYPE>& state, vector<NUM_TYPE>& g) {
+		Vec h = Vector::build(state.size());
+		h->value = state;
+
+		Var total;
+		for (size_t t = begin; t < end; ++t) {
+			h = cell(Vector::constant(inputs[t]), h);
+			if (targets[t].size()) {
+				Var l = loss(h, Vector::constant(targets[t]));
+				total = total.ptr ? total + l : l;
+			}
+		}
+
+		h->eval();
+		state = h->value;
+
+		// no targets, nothing to derive
+		if (!total.ptr) {
+			g.assign(flatten(parameters()).size(), 0.0f);
+			return 0.0f;
+		}
+
+		total->calculateDerivatives();
+		g = flatten(parameters());
+
+		return total->value;
+	}
+
+	TBPTT truncated(size_t length) {
+		return TBPTT(length, 2, 1, { b->size },
+			[this](const Vec& x, const vector<Vec>& s) { return vector<Vec>{ cell(x, s[0]) }; },
+			[this](const vector<Vec>& s, const Vec& y) { return loss(s[0], y); });
+	}
+};
+
+// the sum of the gradients of the chunks, from runSequence and from unrolling each chunk on it's own
+bool chunks(Model& model, size_t length) {
+	size_t n = model.inputs.size();
+
+	vector<NUM_TYPE> expected, state(model.b->size, 0.0f);
+	NUM_TYPE expectedLoss = 0.0f;
+
+	for (size_t begin = 0; begin < n; begin += length) {
+		vector<NUM_TYPE> g;
+		expectedLoss += model.unroll(begin, std::min(n, begin + length), state, g);
+
+		if (expected.empty()) expected.assign(g.size(), 0.0f);
+		for (size_t i = 0; i < g.size(); ++i) expected[i] += g[i];
+	}
+
+	TBPTT truncated = model.truncated(length);
+	vector<NUM_TYPE> sum(expected.size(), 0.0f);
+
+	NUM_TYPE loss = truncated.runSequence(model.inputs, model.targets, [&]() {
+		vector<NUM_TYPE> g = flatten(model.parameters());
+		for (size_t i = 0; i < g.size(); ++i) sum[i] += g[i];
+	});
+
+	return compare("Chunks of " + to_string(length), loss, sum, expectedLoss, expected, 1e-5f);
+}
+
+bool throws(const function<void()>& f) {
+	try {
+		f();
+	} catch (const std::runtime_error& e) {
+		cout << "Throws: " << e.what() << "\n";
+		return true;
+	}
+
+	return false;
+}
+
+
+int main() {
+
+	Model model(16, 100);
+
+	// a single chunk is the whole unrolled sequence
+	bool ok = chunks(model, 100);
+	ok = chunks(model, 7) && ok;
+	ok = chunks(model, 1) && ok;
+
+	// the data of the chunks stays out of the gradient, also when nothing is trainable
+	Model untrainable(16, 5, false);
+	TBPTT truncated = untrainable.truncated(5);
+	truncated.runChunk(untrainable.inputs, untrainable.targets);
+
+	TBPTT::Chunk& chunk = truncated.chunks[5];
+	bool leaves = chunk.wrt.size() == 4 && !chunk.inputs[0]->requiresGrad && !chunk.targets[0]->requiresGrad && !chunk.initial[0]->requiresGrad;
+	cout << "Derived with respect to " << chunk.wrt.size() << " leaves" << (leaves ? "" : ", WRONG LEAVES") << "\n";
+	ok = ok && leaves;
+
+	ok = throws([&]() { truncated.runChunk({ { 1.0f, 2.0f, 3.0f } }); }) && ok;
+	ok = throws([&]() { truncated.runChunk({ { 1.0f, 2.0f } }, { { 1.0f, 2.0f } }); }) && ok;
+	ok = throws([&]() { truncated.runSequence({ { 1.0f, 2.0f } }, { {}, { 1.0f } }); }) && ok;
+
+	return report("TBPTT", ok);
+}
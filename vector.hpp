@@ -109,10 +109,10 @@ struct Vector : Node {
 
 	size_t size;
 	std::vector<NUM_TYPE> value;
-	std::vector<NUM_TYPE> partial;
+	std::vector<NUM_TYPE> partial; // empty until a gradient reaches the node (see accumulatePartial), except leaves
 	Vec gradientFunction;
 
-	Vector(size_t s = 0, NUM_TYPE fillValue = 0.0f, const std::string& n = "", bool trainable = false) : size(s), value(std::vector<NUM_TYPE>(s, fillValue)), partial(std::vector<NUM_TYPE>(s, 0.0f)) {
+	Vector(size_t s = 0, NUM_TYPE fillValue = 0.0f, const std::string& n = "", bool trainable = false) : size(s), value(BufferPool::filled(s, fillValue)) {
 		
 		#if USE_NAME
 			if (n == "") {
@@ -133,8 +133,76 @@ struct Vector : Node {
 		isTrainable = trainable;
 	}
 
+	// with a NodeArena the buffers go back to the BufferPool too, for the next graph to reuse them
+	~Vector() {
+		if (!NodeArena::isActive()) return;
+
+		BufferPool::release(value);
+		BufferPool::release(partial);
+	}
+
 	static Vec build(size_t s = 0, NUM_TYPE fillValue = 0.0f, bool trainable = false, const std::string& n = "") {
-		return std::make_shared<Vector>(s, fillValue, n, trainable);
+		return makeLeaf(s, fillValue, n, trainable);
+	}
+
+	// leaves start with a zero partial, code that updates them may read it even if no graph reaches them. Constants,
+	// operations and what's built in an InferenceMode only get one when a gradient reaches them
+	static std::shared_ptr<Vector> makeLeaf(size_t s, NUM_TYPE fillValue, const std::string& n, bool trainable) {
+		std::shared_ptr<Vector> node = makeNode<Vector>(s, fillValue, n, trainable);
+		if (!InferenceMode::isActive()) node->partial = BufferPool::filled(s, 0.0f);
+
+		return node;
+	}
+
+	static Vec constant(size_t s, NUM_TYPE fillValue = 0.0f) {
+
+		NodeCache::Key key = NodeCache::key<Vector>(s, fillValue);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<Vector> node = makeNode<Vector>(s, fillValue);
+		node->isConstant = true;
+		node->requiresGrad = false;
+
+		NodeCache::store(key, node);
+		return node;
+	}
+
+	static Vec constant(const std::vector<NUM_TYPE>& v) {
+		std::shared_ptr<Vector> node = makeNode<Vector>(v.size());
+		node->value = v;
+		node->isConstant = true;
+		node->requiresGrad = false;
+
+		return node;
+	}
+
+	// an operation on constants is a constant, so evaluate it right away and let go of it's parents
+	static Vec fold(const std::shared_ptr<Vector>& node) {
+		if (!node->hasOnlyConstantParents()) return node;
+
+		node->acquireValue();
+		node->evaluate();
+		return constant(node->value);
+	}
+
+	bool isConstantEqualTo(NUM_TYPE v) const {
+		if (!isConstant) return false;
+
+		for (size_t i = 0; i < size; ++i) {
+			if (value[i] != v) return false;
+		}
+
+		return true;
+	}
+
+	// changes the value of a leaf, and marks it dirty so every graph that reads it sees it
+	void set(const std::vector<NUM_TYPE>& v) {
+		if (v.size() != size) {
+			throw std::runtime_error("Cannot set a vector of size " + std::to_string(size) + " to " + std::to_string(v.size()) + " values");
+		}
+
+		value = v;
+		markDirty();
 	}
 
 	void evaluate() override {
@@ -146,7 +214,59 @@ struct Vector : Node {
 	}
 
 	void resetPartial(NUM_TYPE defaultValue = 0.0f) override final {
+		BufferPool::ensure(partial, size);
 		std::fill(partial.begin(), partial.end(), defaultValue);
+		hasPartial = true;
+	}
+
+	// the partial is only allocated when the first contribution to it arrives, and that first one is written
+	// instead of added, so it's never zeroed just to be added to
+	template <typename F>
+	void accumulatePartial(F contribution) {
+		if (!hasPartial) {
+			BufferPool::ensure(partial, size);
+			for (size_t i = 0; i < size; ++i) {
+				partial[i] = contribution(i);
+			}
+
+			hasPartial = true;
+			return;
+		}
+
+		for (size_t i = 0; i < size; ++i) {
+			partial[i] += contribution(i);
+		}
+	}
+
+	void accumulatePartial(const std::vector<NUM_TYPE>& contribution) {
+		accumulatePartial([&](size_t i) { return contribution[i]; });
+	}
+
+	// for operations that only contribute to some of the elements (indexing, max), the rest have to be zeros
+	std::vector<NUM_TYPE>& touchPartial() {
+		if (!hasPartial) resetPartial();
+		return partial;
+	}
+
+	void releasePartial() override final {
+		BufferPool::release(partial);
+		hasPartial = false;
+	}
+
+	void releaseValue() override final {
+		BufferPool::release(value);
+	}
+
+	void acquireValue() override final {
+		BufferPool::ensure(value, size);
+	}
+
+	std::vector<std::vector<NUM_TYPE>*> valueBuffers() override final {
+		return { &value };
+	}
+
+	size_t hashValue() override final {
+		return hashValues(value);
 	}
 
 	NodeTypes getType() {
@@ -158,7 +278,11 @@ struct Vector : Node {
 	}
 
 	void resetGradientFunction(NUM_TYPE defaultValue = 0.0f) override {
-		gradientFunction = Vector::build(size, defaultValue);
+		gradientFunction = Vector::constant(size, defaultValue);
+	}
+
+	bool isGradientFunctionZero() override final {
+		return gradientFunction.ptr && gradientFunction->isConstantEqualTo(0.0f);
 	}
 
 
@@ -191,7 +315,7 @@ struct Vector : Node {
 		file.read(reinterpret_cast<char*>(&trainable), sizeof(trainable));
 		file.read(reinterpret_cast<char*>(&size), sizeof(size));
 
-		Vec vec(std::make_shared<Vector>(size, 0.0f, "", trainable));
+		Vec vec(makeLeaf(size, 0.0f, "", trainable));
 
 		file.read(reinterpret_cast<char*>(&vec->value[0]), size * sizeof(NUM_TYPE));
 
@@ -240,15 +364,19 @@ struct VectorAddAtPos : Vector {
 	Var b;
 	size_t index;
 
-	VectorAddAtPos(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VectorAddAtPos(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v, const Var& s, size_t index = 0) {
 
-		std::shared_ptr<VectorAddAtPos> node = std::make_shared<VectorAddAtPos>(v->size);
+		// v[i] + 0 = v
+		if (s->isConstantEqualTo(0.0f)) return v;
+
+		NodeCache::Key key = NodeCache::key<VectorAddAtPos>(v, s, index);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<VectorAddAtPos> node = makeNode<VectorAddAtPos>(v->size);
 
 		node->a = v;
 		node->b = s;
@@ -260,7 +388,7 @@ struct VectorAddAtPos : Vector {
 		node->parents.push_back(v);
 		node->parents.push_back(s);
 
-		return node;
+		return NodeCache::insert(key, Vector::fold(node));
 	}
 
 	void evaluate() override final {
@@ -268,9 +396,13 @@ struct VectorAddAtPos : Vector {
 		value[index] += b->value;
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		a->partial += partial;
-		b->partial += partial[index];
+		if (a->requiresGrad) a->accumulatePartial(partial);
+		if (b->requiresGrad) b->accumulatePartial(partial[index]);
 	}
 
 	void updateGradientFunction() override final {
@@ -285,15 +417,19 @@ struct VectorAddVecWithOffset : Vector {
 	Vec b;
 	size_t offset;
 
-	VectorAddVecWithOffset(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VectorAddVecWithOffset(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Vec& v2, size_t offset = 0) {
 
-		std::shared_ptr<VectorAddVecWithOffset> node = std::make_shared<VectorAddVecWithOffset>(v1->size);
+		// v + 0 = v
+		if (v2->isConstantEqualTo(0.0f)) return v1;
+
+		NodeCache::Key key = NodeCache::key<VectorAddVecWithOffset>(v1, v2, offset);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<VectorAddVecWithOffset> node = makeNode<VectorAddVecWithOffset>(v1->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -302,7 +438,7 @@ struct VectorAddVecWithOffset : Vector {
 		node->parents.push_back(v1);
 		node->parents.push_back(v2);
 
-		return node;
+		return NodeCache::insert(key, Vector::fold(node));
 	}
 
 	void evaluate() override final {
@@ -312,12 +448,13 @@ struct VectorAddVecWithOffset : Vector {
 		}
 	}
 
-	void derive() override final {
-		a->partial += partial;
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
 
-		for (size_t i = 0; i < b->size && i + offset < a->size; ++i) {
-			b->partial[i] += partial[i + offset];
-		}
+	void derive() override final {
+		if (a->requiresGrad) a->accumulatePartial(partial);
+		if (b->requiresGrad) b->accumulatePartial([&](size_t i) { return i + offset < a->size ? partial[i + offset] : 0.0f; });
 	}
 
 /*	void updateGradientFunction() override final {
@@ -338,26 +475,32 @@ struct GetVectorElem : Scalar {
 
 	static Var build(const Vec& v, size_t index = 0) {
 
-		std::shared_ptr<GetVectorElem> node = std::make_shared<GetVectorElem>();
+		NodeCache::Key key = NodeCache::key<GetVectorElem>(v, index);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<GetVectorElem> node = makeNode<GetVectorElem>();
 
 		node->a = v;
 		node->index = index;
 		#if USE_NAME
 			node->name = v->name + "[" + std::to_string(index) + "]";
 		#endif
-		node->value = v->value[index];
 
 		node->parents.push_back(v);
 
-		return node;
+		return NodeCache::insert(key, Scalar::fold(node));
 	}
 
 	void evaluate() override final {
 		value = a->value[index];
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
-		a->partial[index] += partial;
+		a->touchPartial()[index] += partial;
 	}
 
 	void updateGradientFunction() override final {
@@ -380,17 +523,18 @@ struct GetVectorElems : Vector {
 	Vec a;
 	size_t start, end;
 
-	GetVectorElems(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	GetVectorElems(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v, size_t start, size_t end) {
 
 		if (end < start) std::swap(start, end);
 
-		std::shared_ptr<GetVectorElems> node = std::make_shared<GetVectorElems>(end - start);
+		NodeCache::Key key = NodeCache::key<GetVectorElems>(v, start, end);
+		if (std::shared_ptr<Node> cached = NodeCache::find(key)) return cached;
+
+		std::shared_ptr<GetVectorElems> node = makeNode<GetVectorElems>(end - start);
 
 		node->a = v;
 		node->start = start;
@@ -399,13 +543,9 @@ struct GetVectorElems : Vector {
 			node->name = v->name + "[" + std::to_string(start) + ", " + std::to_string(end) + "]";
 		#endif
 
-		for (size_t i = 0; i < end - start; ++i) {
-			node->value[i] = node->a->value[i + start];
-		}
-
 		node->parents.push_back(v);
 
-		return node;
+		return NodeCache::insert(key, Vector::fold(node));
 	}
 
 	void evaluate() override final {
@@ -414,9 +554,15 @@ struct GetVectorElems : Vector {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
+		std::vector<NUM_TYPE>& aPartial = a->touchPartial();
+
 		for (size_t i = 0; i < end - start; ++i) {
-			a->partial[i + start] += partial[i];
+			aPartial[i + start] += partial[i];
 		}
 	}
 
@@ -443,20 +589,17 @@ Vec Vector::get(size_t start, size_t end) {
 struct VectorFromScalars : Vector {
 	std::vector<Var> a;
 
-	VectorFromScalars(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VectorFromScalars(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const std::vector<Var>& vars) {
 
-		std::shared_ptr<VectorFromScalars> node = std::make_shared<VectorFromScalars>(vars.size());
+		std::shared_ptr<VectorFromScalars> node = makeNode<VectorFromScalars>(vars.size());
 
 		node->a = vars;
 		for (size_t i = 0; i < vars.size(); ++i) {
 			node->parents.push_back(vars[i]);
-			node->value[i] = vars[i]->value;
 		}
 
 		return node;
@@ -468,9 +611,13 @@ struct VectorFromScalars : Vector {
 		}
 	}
 
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
+
 	void derive() override final {
 		for (size_t i = 0; i < size; ++i) {
-			a[i]->partial += partial[i];
+			if (a[i]->requiresGrad) a[i]->accumulatePartial(partial[i]);
 		}
 	}
 
@@ -488,15 +635,13 @@ struct VectorFromScalars : Vector {
 struct VectorConcat : Vector {
 	Vec a, b;
 
-	VectorConcat(size_t s = 0, NUM_TYPE fillValue = 0.0f) {
+	VectorConcat(size_t s = 0) {
 		size = s;
-		value = std::vector<NUM_TYPE>(s, fillValue);
-		partial = std::vector<NUM_TYPE>(s, 0.0f);
 	}
 
 	static Vec build(const Vec& v1, const Vec& v2) {
 
-		std::shared_ptr<VectorConcat> node = std::make_shared<VectorConcat>(v1->size + v2->size);
+		std::shared_ptr<VectorConcat> node = makeNode<VectorConcat>(v1->size + v2->size);
 
 		node->a = v1;
 		node->b = v2;
@@ -517,14 +662,13 @@ struct VectorConcat : Vector {
 		}
 	}
 
-	void derive() override final {
-		for (size_t i = 0; i < a->size; ++i) {
-			a->partial[i] += partial[i];
-		}
+	bool deriveReads(const Node*) const override final {
+		return false;
+	}
 
-		for (size_t i = 0; i < b->size; ++i) {
-			b->partial[i] += partial[i + a->size];
-		}
+	void derive() override final {
+		if (a->requiresGrad) a->accumulatePartial([&](size_t i) { return partial[i]; });
+		if (b->requiresGrad) b->accumulatePartial([&](size_t i) { return partial[i + a->size]; });
 	}
 
 